@@ -4,10 +4,15 @@
 #include <string.h>
 #include <sys/unistd.h>
 #include "esp_log.h"
+#include "sdkconfig.h"
 #include "driver/uart.h"
+#include "nvs_flash.h"
 #include <ctype.h>
 #include "storage.h"
 #include "tables.h"
+#include "protocol.h"
+#include "power_loss.h"
+#include "trace.h"
 #define TAG "demo"
 
 #define UART_NUM UART_NUM_0
@@ -16,6 +21,9 @@
 #define STORAGE_PARTITION_NAME "storage"
 #define DEMO_BASE_PATH "/spiffs"
 #define DEMO_TABLE_FILENAME "/demo"
+#define DEMO_POWER_LOSS_FILENAME "/plt"
+#define DEMO_SNAPSHOT_FILENAME "/demo.snp"
+#define DEMO_TRACE_FILENAME "/trace.json"
 #define DEMO_MAX_FILES 3  /* 1 used only */
 
 #define TABLE_DEMO_MAX_RECORDS 15
@@ -23,7 +31,43 @@
 
 
 #define DEMO_TABLE_FULLPATH DEMO_BASE_PATH DEMO_TABLE_FILENAME
+#define DEMO_SNAPSHOT_FULLPATH DEMO_BASE_PATH DEMO_SNAPSHOT_FILENAME
+#define DEMO_TRACE_FULLPATH DEMO_BASE_PATH DEMO_TRACE_FILENAME
 
+#define DEMO_SCRUB_MAX_REPORTED 4
+
+// small on purpose, so that sorting the demo table goes through merge passes
+#define DEMO_SORT_SCRATCH_RECORDS 4
+
+static char sort_scratch[DEMO_SORT_SCRATCH_RECORDS * (USER_DATA_SIZE + 4)];
+
+// records changed since the last delta sync (binary mode DELTA command)
+static uint8_t snapshot_bitmap[TABLE_SNAPSHOT_BITMAP_SIZE(TABLE_DEMO_MAX_RECORDS)];
+
+int demo_compare(const void *a, const void *b)
+{
+  return strncmp((const char*)a, (const char*)b, USER_DATA_SIZE);
+}
+
+
+void storage_stats_demo (void)
+{
+  storage_statistics_type statistics;
+
+  storage_get_statistics(&statistics);
+  printf("writes: %lu, stalls: %lu, avg: %lld us, max: %lld us\n",
+         (unsigned long) statistics.writes,
+         (unsigned long) statistics.write_stalls,
+         statistics.writes ? statistics.write_time_us/statistics.writes : 0,
+         statistics.write_max_us);
+  printf("idle gc: %lu slices, %lu skipped, %lu failed, total: %lld us, max: %lld us, dirty: %u bytes\n\n",
+         (unsigned long) statistics.gc_slices,
+         (unsigned long) statistics.gc_skipped,
+         (unsigned long) statistics.gc_failures,
+         statistics.gc_time_us,
+         statistics.gc_max_us,
+         (unsigned) statistics.dirty_estimate);
+}
 
 void menu_demo (table_handle_type *handle, char* user_data)
 {
@@ -50,6 +94,17 @@ void menu_demo (table_handle_type *handle, char* user_data)
       printf("r (replace)\t\tReplace a record\n");
       printf("d (delete)\t\tDelete a record\n");
       printf("l (list)\t\tList all records\n");
+      printf("o (order)\t\tSort the records\n");
+      printf("x (dedup)\t\tSort the records and drop duplicates\n");
+      printf("s (stats)\t\tPrint storage statistics\n");
+      printf("b (binary)\t\tEnter binary bulk load/export mode\n");
+#ifdef CONFIG_STORAGE_TRACE
+      printf("t (trace)\t\tDump the operation trace (Chrome trace JSON)\n");
+      printf("j (trace file)\t\tWrite the operation trace to " DEMO_TRACE_FULLPATH "\n");
+#endif
+#ifdef CONFIG_STORAGE_FAULT_INJECTION
+      printf("p (power loss)\t\tRun the power-loss harness\n");
+#endif
       printf("h (help)\t\tPrint this help\n");
       printf("\n");
       fsm=1;
@@ -102,6 +157,63 @@ void menu_demo (table_handle_type *handle, char* user_data)
         case 'h':
           fsm=0;
         break;
+        case 'o':
+          if (!table_sort(handle, demo_compare, sort_scratch, sizeof(sort_scratch))) {
+            printf("sort failed\n\n");
+          }
+          else {
+            printf("sort ok\n\n");
+          }
+          fsm=1;
+        break;
+        case 'x':
+          if (!table_dedup(handle, demo_compare, sort_scratch, sizeof(sort_scratch))) {
+            printf("dedup failed\n\n");
+          }
+          else {
+            printf("dedup ok, %d records left\n\n", handle->used_records);
+          }
+          fsm=1;
+        break;
+        case 's':
+          storage_stats_demo();
+          fsm=1;
+        break;
+#ifdef CONFIG_STORAGE_FAULT_INJECTION
+        case 'p':
+          if (!power_loss_run(STORAGE_PARTITION_NAME,
+                              DEMO_BASE_PATH,
+                              DEMO_MAX_FILES,
+                              DEMO_BASE_PATH DEMO_POWER_LOSS_FILENAME)) {
+            printf("power loss harness failed\n\n");
+          }
+          fsm=1;
+        break;
+#endif
+#ifdef CONFIG_STORAGE_TRACE
+        case 't':
+          trace_dump(stdout);
+          trace_clear();
+          printf("\n");
+          fsm=1;
+        break;
+        case 'j':
+          // read it back from a partition dump, e.g. parttool.py read_partition
+          if (trace_dump_to_file(DEMO_TRACE_FULLPATH)) {
+            trace_clear();
+            printf("trace written to %s\n\n", DEMO_TRACE_FULLPATH);
+          }
+          else {
+            printf("trace_dump_to_file failed\n\n");
+          }
+          fsm=1;
+        break;
+#endif
+        case 'b':
+          protocol_run(handle, UART_NUM);
+          printf("binary mode finished\n\n");
+          fsm=1;
+        break;
         case 'l':
           if (!table_count(handle)) {
             printf("table_count error\n");            
@@ -239,12 +351,42 @@ void menu_demo (table_handle_type *handle, char* user_data)
   }
 }
 
+void scrub_demo (table_handle_type *handle)
+{
+#ifdef CONFIG_TABLE_RECORD_CRC
+  uint16_t corrupted[DEMO_SCRUB_MAX_REPORTED];
+  uint16_t corrupted_count;
+
+  if (!table_scrub(handle, 
+                   CONFIG_TABLE_SCRUB_RECORDS_PER_TICK,
+                   corrupted,
+                   DEMO_SCRUB_MAX_REPORTED,
+                   &corrupted_count)) {
+    return;
+  }
+  for (uint16_t i=0; i<corrupted_count; i++) {
+    printf("scrub: record %d corrupted\n", corrupted[i]);
+  }
+#endif
+}
+
 void app_main(void)
 {
     size_t total, used;
         
-    table_handle_type handle;
+    table_handle_type handle = { 0 };
     char user_data[USER_DATA_SIZE];   
+    esp_err_t ret;
+
+    ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+      ESP_ERROR_CHECK(nvs_flash_erase());
+      ret = nvs_flash_init();
+    }
+    if (ESP_OK!=ret) {
+      ESP_LOGE(TAG, "nvs_flash_init failed");
+      goto app_main_loop;
+    }
     
     if (ESP_OK!=storage_init( STORAGE_PARTITION_NAME, 
                               DEMO_BASE_PATH,
@@ -268,13 +410,23 @@ void app_main(void)
       goto app_main_loop;                   
                    
     }
+
+    if (!table_snapshot_init(&handle,
+                             DEMO_SNAPSHOT_FULLPATH,
+                             snapshot_bitmap,
+                             sizeof(snapshot_bitmap))) {
+      ESP_LOGE(TAG, "table_snapshot_init failed");
+      goto app_main_loop;
+    }
         
 app_main_loop:
 
 
-    uart_driver_install(UART_NUM, 1024, 0, 0, NULL, 0);    
+    uart_driver_install(UART_NUM, PROTOCOL_UART_RX_BUFFER, 0, 0, NULL, 0);    
     while (1) {
       menu_demo(&handle, user_data);
+      scrub_demo(&handle);
+      storage_maintenance();
       vTaskDelay(20/portTICK_PERIOD_MS);
     }
 }
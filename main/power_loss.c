@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "storage.h"
+#include "tables.h"
+#include "power_loss.h"
+#define TAG "power_loss"
+
+#ifdef CONFIG_STORAGE_FAULT_INJECTION
+
+typedef enum {
+  POWER_LOSS_APPEND,
+  POWER_LOSS_INSERT,
+  POWER_LOSS_DELETE,
+  POWER_LOSS_REPLACE,
+  POWER_LOSS_OPERATIONS,
+} power_loss_operation_type;
+
+static const char *power_loss_names[POWER_LOSS_OPERATIONS] = {
+  "append", "insert", "delete", "replace"
+};
+
+#define POWER_LOSS_REPLACE_INDEX (POWER_LOSS_SEED_RECORDS / 2)
+
+static table_handle_type handle;
+static char user_data[POWER_LOSS_RECORD_SIZE];
+static char before[POWER_LOSS_CAPACITY][POWER_LOSS_RECORD_SIZE];
+static char after[POWER_LOSS_CAPACITY][POWER_LOSS_RECORD_SIZE];
+static char found[POWER_LOSS_CAPACITY][POWER_LOSS_RECORD_SIZE];
+
+void power_loss_record(char *record, const char *tag, int number)
+{
+  memset(record, 0, POWER_LOSS_RECORD_SIZE);
+  snprintf(record, POWER_LOSS_RECORD_SIZE, "%s-%d", tag, number);
+}
+
+/* Fills 'after' with the expected table content once 'operation' completes */
+uint16_t power_loss_expected(power_loss_operation_type operation)
+{
+  uint16_t count = POWER_LOSS_SEED_RECORDS;
+
+  memcpy(after, before, sizeof(before));
+  switch (operation) {
+    case POWER_LOSS_APPEND:
+      memcpy(after[count], user_data, POWER_LOSS_RECORD_SIZE);
+      count++;
+    break;
+    case POWER_LOSS_INSERT:
+      memmove(after[1], before[0], count * POWER_LOSS_RECORD_SIZE);
+      memcpy(after[0], user_data, POWER_LOSS_RECORD_SIZE);
+      count++;
+    break;
+    case POWER_LOSS_DELETE:
+      memmove(after[0], before[1], (count - 1) * POWER_LOSS_RECORD_SIZE);
+      count--;
+    break;
+    case POWER_LOSS_REPLACE:
+      memcpy(after[POWER_LOSS_REPLACE_INDEX], user_data, POWER_LOSS_RECORD_SIZE);
+    break;
+    default:
+    break;
+  }
+  return count;
+}
+
+bool power_loss_apply(power_loss_operation_type operation)
+{
+  switch (operation) {
+    case POWER_LOSS_APPEND:
+      return table_append(&handle);
+    case POWER_LOSS_INSERT:
+      return table_insert_index(&handle, 0);
+    case POWER_LOSS_DELETE:
+      return table_delete_index(&handle, 0);
+    case POWER_LOSS_REPLACE:
+      return table_replace_index(&handle, POWER_LOSS_REPLACE_INDEX);
+    default:
+      return false;
+  }
+}
+
+/* Recreates the table holding the seed records */
+bool power_loss_prepare(char *table_path)
+{
+  storage_file_delete(table_path);
+  if (!table_init(&handle, table_path, user_data, POWER_LOSS_RECORD_SIZE, POWER_LOSS_CAPACITY)) {
+    return false;
+  }
+  for (int i = 0; i < POWER_LOSS_SEED_RECORDS; i++) {
+    power_loss_record(before[i], "seed", i);
+  }
+  return table_append_many(&handle, (char*) before, POWER_LOSS_SEED_RECORDS);
+}
+
+const char *power_loss_verify(uint16_t after_count)
+{
+  uint16_t used = handle.used_records;
+
+  if (used > POWER_LOSS_CAPACITY) {
+    return "BAD COUNT";
+  }
+  if (!table_read_range(&handle, 0, used, (char*) found)) {
+    return "UNREADABLE";
+  }
+  if (POWER_LOSS_SEED_RECORDS == used &&
+      0 == memcmp(found, before, used * POWER_LOSS_RECORD_SIZE)) {
+    return "before";
+  }
+  if (after_count == used &&
+      0 == memcmp(found, after, used * POWER_LOSS_RECORD_SIZE)) {
+    return "after";
+  }
+  return "TORN";
+}
+
+bool power_loss_run(char *partition_label,
+                    char *base_path,
+                    size_t max_files,
+                    char *table_path)
+{
+  int violations = 0;
+  int64_t worst_recovery_us = 0;
+
+  for (int operation = 0; operation < POWER_LOSS_OPERATIONS; operation++) {
+    // the loop below ends once the operation completes before the cut point
+    if (!power_loss_prepare(table_path) || !power_loss_apply(operation)) {
+      ESP_LOGE(TAG, "%s fails without power cut", power_loss_names[operation]);
+      return false;
+    }
+    table_deinit(&handle);
+
+    for (uint32_t cut = 1; ; cut++) {
+      const char *result;
+      uint16_t after_count;
+      bool completed;
+      int64_t started_us, mounted_us, initialised_us;
+
+      if (!power_loss_prepare(table_path)) {
+        ESP_LOGE(TAG, "power_loss_prepare failed");
+        return false;
+      }
+      power_loss_record(user_data, "new", cut);
+      after_count = power_loss_expected(operation);
+
+      storage_fault_arm(cut);
+      completed = power_loss_apply(operation);
+
+      // "reboot" before disarming, so that no table write gets through
+      table_deinit(&handle);
+      storage_deinit();
+      storage_fault_arm(0);
+      started_us = esp_timer_get_time();
+      if (ESP_OK != storage_init(partition_label, base_path, max_files)) {
+        ESP_LOGE(TAG, "storage_init failed after cut %lu", (unsigned long) cut);
+        return false;
+      }
+      mounted_us = esp_timer_get_time();
+      if (!table_init(&handle, table_path, user_data, POWER_LOSS_RECORD_SIZE, POWER_LOSS_CAPACITY)) {
+        initialised_us = esp_timer_get_time();
+        result = "NO INIT";
+      }
+      else {
+        initialised_us = esp_timer_get_time();
+        result = power_loss_verify(after_count);
+      }
+      table_deinit(&handle);
+
+      if (strcmp(result, "before") && strcmp(result, "after")) {
+        violations++;
+      }
+      if (initialised_us - started_us > worst_recovery_us) {
+        worst_recovery_us = initialised_us - started_us;
+      }
+      printf("%-8s cut %4lu %-10s mount %8lld us, table_init %8lld us\n",
+             power_loss_names[operation],
+             (unsigned long) cut,
+             result,
+             (long long) (mounted_us - started_us),
+             (long long) (initialised_us - mounted_us));
+
+      if (completed) {
+        break;
+      }
+    }
+  }
+  storage_file_delete(table_path);
+  // cuts at the file level leave SPIFFS consistent and unmount cleanly, so the
+  // times above are those of a clean remount, not of recovery from a reset
+  printf("power loss: %d violations, worst remount %lld us\n\n",
+         violations, (long long) worst_recovery_us);
+  return 0 == violations;
+}
+
+#else
+
+bool power_loss_run(char *partition_label,
+                    char *base_path,
+                    size_t max_files,
+                    char *table_path)
+{
+  ESP_LOGE(TAG, "CONFIG_STORAGE_FAULT_INJECTION is not set");
+  return false;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef POWER_LOSS_H
+#define POWER_LOSS_H
+
+/* Power-loss harness: runs every table mutation with a simulated power cut at
+ * each of its writes (CONFIG_STORAGE_FAULT_INJECTION), remounts, reinitialises
+ * the table and checks that it holds either the state before or the state after
+ * the operation. Mount and table_init times are reported for every cut point.
+ * The cuts happen at the file level, above SPIFFS, so they check the table
+ * invariants; the mount times are those of a clean remount. */
+
+#define POWER_LOSS_CAPACITY 12
+#define POWER_LOSS_SEED_RECORDS 8
+#define POWER_LOSS_RECORD_SIZE 16
+
+bool power_loss_run(char *partition_label,
+                    char *base_path,
+                    size_t max_files,
+                    char *table_path);
+#endif
@@ -0,0 +1,346 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "driver/uart.h"
+#include "tables.h"
+#include "protocol.h"
+#define TAG "protocol"
+
+#define PROTOCOL_FRAME_SIZE (PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD + PROTOCOL_CRC_SIZE)
+
+static uint8_t rx_frame[PROTOCOL_FRAME_SIZE];
+static uint8_t tx_frame[PROTOCOL_FRAME_SIZE];
+
+#define RX_PAYLOAD (rx_frame + PROTOCOL_HEADER_SIZE)
+#define TX_PAYLOAD (tx_frame + PROTOCOL_HEADER_SIZE)
+
+uint16_t protocol_get_u16(const uint8_t *raw)
+{
+  return raw[0] | (raw[1] << 8);
+}
+
+void protocol_put_u16(uint8_t *raw, uint16_t value)
+{
+  raw[0] = value & 0xFF;
+  raw[1] = value >> 8;
+}
+
+uint32_t protocol_get_u32(const uint8_t *raw)
+{
+  return protocol_get_u16(raw) | ((uint32_t)protocol_get_u16(raw + 2) << 16);
+}
+
+void protocol_put_u32(uint8_t *raw, uint32_t value)
+{
+  protocol_put_u16(raw, value & 0xFFFF);
+  protocol_put_u16(raw + 2, value >> 16);
+}
+
+// CRC of length, command, sequence and payload (everything but SOF)
+uint32_t protocol_crc(const uint8_t *frame, uint16_t len)
+{
+  return esp_rom_crc32_le(0, frame + 1, PROTOCOL_HEADER_SIZE - 1 + len);
+}
+
+/* Sends a frame whose payload has already been written at TX_PAYLOAD */
+bool protocol_send(int uart_num, uint8_t cmd, uint8_t seq, uint16_t len)
+{
+  uint32_t crc;
+  int frame_size = PROTOCOL_HEADER_SIZE + len + PROTOCOL_CRC_SIZE;
+
+  tx_frame[0] = PROTOCOL_SOF;
+  protocol_put_u16(tx_frame + 1, len);
+  tx_frame[3] = cmd;
+  tx_frame[4] = seq;
+  crc = protocol_crc(tx_frame, len);
+  for (int i = 0; i < PROTOCOL_CRC_SIZE; i++) {
+    TX_PAYLOAD[len + i] = (crc >> (8 * i)) & 0xFF;
+  }
+  return frame_size == uart_write_bytes(uart_num, tx_frame, frame_size);
+}
+
+bool protocol_respond(int uart_num, uint8_t cmd, uint8_t seq, uint8_t status, uint16_t extra_len)
+{
+  TX_PAYLOAD[0] = status;
+  return protocol_send(uart_num, cmd | PROTOCOL_RESPONSE, seq, 1 + extra_len);
+}
+
+/* Waits for a frame and leaves its payload at RX_PAYLOAD. Bytes before the
+ * SOF (console output, line noise) are skipped. */
+uint8_t protocol_receive(int uart_num, uint8_t *cmd, uint8_t *seq, uint16_t *len, uint32_t timeout_ms)
+{
+  uint32_t crc = 0;
+
+  *cmd = 0;
+  *seq = 0;
+  do {
+    if (1 != uart_read_bytes(uart_num, rx_frame, 1, timeout_ms / portTICK_PERIOD_MS)) {
+      return PROTOCOL_STATUS_TIMEOUT;
+    }
+  } while (rx_frame[0] != PROTOCOL_SOF);
+
+  if (PROTOCOL_HEADER_SIZE - 1 != uart_read_bytes(uart_num, rx_frame + 1, PROTOCOL_HEADER_SIZE - 1,
+                                                  PROTOCOL_ACK_TIMEOUT_MS / portTICK_PERIOD_MS)) {
+    return PROTOCOL_STATUS_BAD_FRAME;  // truncated frame
+  }
+  *len = protocol_get_u16(rx_frame + 1);
+  *cmd = rx_frame[3];
+  *seq = rx_frame[4];
+  if (*len > PROTOCOL_MAX_PAYLOAD) {
+    return PROTOCOL_STATUS_BAD_FRAME;
+  }
+
+  // payload and CRC arrive in one read, at line rate
+  if (*len + PROTOCOL_CRC_SIZE != uart_read_bytes(uart_num, RX_PAYLOAD, *len + PROTOCOL_CRC_SIZE,
+                                                  PROTOCOL_ACK_TIMEOUT_MS / portTICK_PERIOD_MS)) {
+    return PROTOCOL_STATUS_BAD_FRAME;  // truncated frame
+  }
+  for (int i = PROTOCOL_CRC_SIZE - 1; i >= 0; i--) {
+    crc = (crc << 8) | RX_PAYLOAD[*len + i];
+  }
+  if (crc != protocol_crc(rx_frame, *len)) {
+    return PROTOCOL_STATUS_BAD_FRAME;
+  }
+  return PROTOCOL_STATUS_OK;
+}
+
+void protocol_info(table_handle_type *handle, int uart_num, uint8_t seq)
+{
+  TX_PAYLOAD[1] = PROTOCOL_VERSION;
+  protocol_put_u16(TX_PAYLOAD + 2, handle->user_data_size);
+  protocol_put_u16(TX_PAYLOAD + 4, handle->capacity);
+  protocol_put_u16(TX_PAYLOAD + 6, handle->used_records);
+  protocol_put_u16(TX_PAYLOAD + 8, PROTOCOL_MAX_PAYLOAD);
+  protocol_respond(uart_num, PROTOCOL_CMD_INFO, seq, PROTOCOL_STATUS_OK, 9);
+}
+
+void protocol_append(table_handle_type *handle, int uart_num, uint8_t seq, uint16_t len)
+{
+  uint8_t status = PROTOCOL_STATUS_OK;
+
+  if (0 == len || 0 != len % handle->user_data_size) {
+    status = PROTOCOL_STATUS_BAD_REQUEST;
+  }
+  else if (!table_append_many(handle, (char*)RX_PAYLOAD, len / handle->user_data_size)) {
+    status = PROTOCOL_STATUS_TABLE_ERROR;
+  }
+  protocol_put_u16(TX_PAYLOAD + 1, handle->used_records);
+  protocol_respond(uart_num, PROTOCOL_CMD_APPEND, seq, status, 2);
+}
+
+/* Waits for the ACK of the DATA frames sent so far and updates the count of
+ * frames still unacknowledged. */
+uint8_t protocol_wait_ack(int uart_num, uint8_t data_seq, uint8_t *outstanding)
+{
+  uint8_t cmd, ack_seq, status;
+  uint16_t ack_len;
+
+  status = protocol_receive(uart_num, &cmd, &ack_seq, &ack_len, PROTOCOL_ACK_TIMEOUT_MS);
+  if (PROTOCOL_STATUS_OK != status) {
+    return status;
+  }
+  if (PROTOCOL_CMD_ACK != cmd) {
+    return PROTOCOL_STATUS_BAD_REQUEST;
+  }
+  // ack_seq is the last DATA frame received in order
+  *outstanding = (uint8_t)(data_seq - ack_seq - 1);
+  return PROTOCOL_STATUS_OK;
+}
+
+/* Streams records as DATA frames, keeping at most 'window' of them
+ * unacknowledged, then answers the EXPORT request. */
+void protocol_export(table_handle_type *handle, int uart_num, uint8_t seq, uint16_t len)
+{
+  uint8_t status = PROTOCOL_STATUS_OK;
+  uint16_t from, count, sent = 0;
+  uint8_t window, outstanding = 0, data_seq = 0;
+  uint16_t per_frame = (PROTOCOL_MAX_PAYLOAD - 2) / handle->user_data_size;
+
+  if (5 != len) {
+    status = PROTOCOL_STATUS_BAD_REQUEST;
+    goto protocol_export_end;
+  }
+  from = protocol_get_u16(RX_PAYLOAD);
+  count = protocol_get_u16(RX_PAYLOAD + 2);
+  window = RX_PAYLOAD[4];
+  if (0 == window || 0 == per_frame ||
+      from > handle->used_records || count > handle->used_records - from) {
+    status = PROTOCOL_STATUS_BAD_REQUEST;
+    goto protocol_export_end;
+  }
+
+  while (sent < count || outstanding > 0) {
+    if (sent < count && outstanding < window) {
+      uint16_t records = (count - sent > per_frame) ? per_frame : count - sent;
+
+      protocol_put_u16(TX_PAYLOAD, from + sent);
+      if (!table_read_range(handle, from + sent, records, (char*)TX_PAYLOAD + 2)) {
+        status = PROTOCOL_STATUS_TABLE_ERROR;
+        goto protocol_export_end;
+      }
+      protocol_send(uart_num, PROTOCOL_CMD_DATA, data_seq, 2 + records * handle->user_data_size);
+      data_seq++;
+      outstanding++;
+      sent += records;
+    }
+    else {
+      status = protocol_wait_ack(uart_num, data_seq, &outstanding);
+      if (PROTOCOL_STATUS_OK != status) {
+        goto protocol_export_end;
+      }
+    }
+  }
+protocol_export_end:
+  protocol_put_u16(TX_PAYLOAD + 1, sent);
+  protocol_respond(uart_num, PROTOCOL_CMD_EXPORT, seq, status, 2);
+}
+
+typedef struct {
+  int uart_num;
+  uint16_t user_data_size;
+  uint8_t window;
+  uint8_t outstanding;
+  uint8_t data_seq;
+  uint16_t len;             // DATA payload bytes not sent yet
+  uint16_t sent;            // records
+  uint8_t status;
+} protocol_delta_type;
+
+bool protocol_delta_flush(protocol_delta_type *delta)
+{
+  if (0 == delta->len) {
+    return true;
+  }
+  while (delta->outstanding >= delta->window) {
+    delta->status = protocol_wait_ack(delta->uart_num, delta->data_seq, &delta->outstanding);
+    if (PROTOCOL_STATUS_OK != delta->status) {
+      return false;
+    }
+  }
+  protocol_send(delta->uart_num, PROTOCOL_CMD_DATA, delta->data_seq, delta->len);
+  delta->data_seq++;
+  delta->outstanding++;
+  delta->len = 0;
+  return true;
+}
+
+bool protocol_delta_callback(const char *record, uint16_t index, void *ctx)
+{
+  protocol_delta_type *delta = ctx;
+
+  if (delta->len + 2 + delta->user_data_size > PROTOCOL_MAX_PAYLOAD && !protocol_delta_flush(delta)) {
+    return false;
+  }
+  protocol_put_u16(TX_PAYLOAD + delta->len, index);
+  memcpy(TX_PAYLOAD + delta->len + 2, record, delta->user_data_size);
+  delta->len += 2 + delta->user_data_size;
+  delta->sent++;
+  return true;
+}
+
+/* Streams the records changed since a snapshot and starts a new one. If the
+ * last frames are lost the host keeps its old snapshot id, which no longer
+ * matches, so its next DELTA is a full export. */
+void protocol_delta(table_handle_type *handle, int uart_num, uint8_t seq, uint16_t len)
+{
+  uint32_t since, snapshot_id = 0;
+  uint16_t used_records = 0;
+  bool full = false;
+  protocol_delta_type delta = {
+    .uart_num = uart_num,
+    .user_data_size = handle->user_data_size,
+    .status = PROTOCOL_STATUS_OK,
+  };
+
+  if (5 != len) {
+    delta.status = PROTOCOL_STATUS_BAD_REQUEST;
+    goto protocol_delta_end;
+  }
+  since = protocol_get_u32(RX_PAYLOAD);
+  delta.window = RX_PAYLOAD[4];
+  if (0 == delta.window || 2 + handle->user_data_size > PROTOCOL_MAX_PAYLOAD) {
+    delta.status = PROTOCOL_STATUS_BAD_REQUEST;
+    goto protocol_delta_end;
+  }
+  if (!table_export_delta(handle, since, protocol_delta_callback, &delta, &snapshot_id, &used_records, &full)) {
+    if (PROTOCOL_STATUS_OK == delta.status) {
+      delta.status = PROTOCOL_STATUS_TABLE_ERROR;
+    }
+    goto protocol_delta_end;
+  }
+  if (!protocol_delta_flush(&delta)) {
+    goto protocol_delta_end;
+  }
+  while (delta.outstanding > 0) {
+    delta.status = protocol_wait_ack(uart_num, delta.data_seq, &delta.outstanding);
+    if (PROTOCOL_STATUS_OK != delta.status) {
+      goto protocol_delta_end;
+    }
+  }
+protocol_delta_end:
+  TX_PAYLOAD[1] = full;
+  protocol_put_u16(TX_PAYLOAD + 2, used_records);
+  protocol_put_u32(TX_PAYLOAD + 4, snapshot_id);
+  protocol_put_u16(TX_PAYLOAD + 8, delta.sent);
+  protocol_respond(uart_num, PROTOCOL_CMD_DELTA, seq, delta.status, 9);
+}
+
+// drops log output while frames are on the UART
+int protocol_log_discard(const char *format, va_list args)
+{
+  return 0;
+}
+
+/* Serves binary frames until EXIT or PROTOCOL_IDLE_TIMEOUT_MS of silence.
+ * Log output is discarded meanwhile so that it does not interleave with
+ * frames; log levels are left untouched. */
+void protocol_run(table_handle_type *handle, int uart_num)
+{
+  uint8_t cmd, seq, status;
+  uint16_t len;
+  bool running = true;
+  vprintf_like_t log_vprintf;
+
+  log_vprintf = esp_log_set_vprintf(protocol_log_discard);
+  while (running) {
+    status = protocol_receive(uart_num, &cmd, &seq, &len, PROTOCOL_IDLE_TIMEOUT_MS);
+    if (PROTOCOL_STATUS_TIMEOUT == status) {
+      break;
+    }
+    if (PROTOCOL_STATUS_OK != status) {
+      protocol_respond(uart_num, cmd, seq, status, 0);
+      continue;
+    }
+    switch (cmd) {
+      case PROTOCOL_CMD_INFO:
+        protocol_info(handle, uart_num, seq);
+      break;
+      case PROTOCOL_CMD_CLEAN:
+        protocol_respond(uart_num, cmd, seq,
+                         table_clean(handle) ? PROTOCOL_STATUS_OK : PROTOCOL_STATUS_TABLE_ERROR, 0);
+      break;
+      case PROTOCOL_CMD_APPEND:
+        protocol_append(handle, uart_num, seq, len);
+      break;
+      case PROTOCOL_CMD_EXPORT:
+        protocol_export(handle, uart_num, seq, len);
+      break;
+      case PROTOCOL_CMD_DELTA:
+        protocol_delta(handle, uart_num, seq, len);
+      break;
+      case PROTOCOL_CMD_EXIT:
+        protocol_respond(uart_num, cmd, seq, PROTOCOL_STATUS_OK, 0);
+        running = false;
+      break;
+      default:
+        protocol_respond(uart_num, cmd, seq, PROTOCOL_STATUS_BAD_REQUEST, 0);
+      break;
+    }
+  }
+  uart_wait_tx_done(uart_num, PROTOCOL_ACK_TIMEOUT_MS / portTICK_PERIOD_MS);
+  esp_log_set_vprintf(log_vprintf);
+}
@@ -0,0 +1,43 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+/* Framed binary protocol for bulk load/export of a table over UART.
+ *
+ * frame: SOF | length (u16 LE) | command (u8) | sequence (u8) | payload | CRC32 (LE)
+ * The CRC32 (zlib polynomial) covers length, command, sequence and payload.
+ * Every request gets a response with command|PROTOCOL_RESPONSE, the same
+ * sequence and a status byte as first payload byte.
+ *
+ * DELTA streams, as DATA frames of index (u16) + record entries, the records
+ * changed since the given snapshot (all of them for snapshot 0 or an unknown
+ * one), then answers with full (u8), used_records (u16), the new snapshot
+ * (u32) and the records sent (u16). The host keeps its copy in sync by
+ * patching those records and truncating it to used_records. */
+
+#define PROTOCOL_VERSION 1
+#define PROTOCOL_SOF 0xA5
+#define PROTOCOL_MAX_PAYLOAD 1024
+#define PROTOCOL_HEADER_SIZE 5
+#define PROTOCOL_CRC_SIZE 4
+#define PROTOCOL_UART_RX_BUFFER 4096   // holds a few pipelined frames while flash is written
+#define PROTOCOL_IDLE_TIMEOUT_MS 5000  // back to the text menu after this much silence
+#define PROTOCOL_ACK_TIMEOUT_MS 1000
+
+#define PROTOCOL_CMD_INFO   0x01  // -> version, user_data_size, capacity, used_records
+#define PROTOCOL_CMD_CLEAN  0x02
+#define PROTOCOL_CMD_APPEND 0x03  // payload: whole records, appended in one batch
+#define PROTOCOL_CMD_EXPORT 0x04  // payload: from (u16), count (u16), window (u8)
+#define PROTOCOL_CMD_DATA   0x05  // export data: records, sent by the device
+#define PROTOCOL_CMD_ACK    0x06  // host acknowledges export data up to a sequence
+#define PROTOCOL_CMD_EXIT   0x07
+#define PROTOCOL_CMD_DELTA  0x08  // payload: since snapshot (u32), window (u8)
+#define PROTOCOL_RESPONSE   0x80
+
+#define PROTOCOL_STATUS_OK          0
+#define PROTOCOL_STATUS_BAD_FRAME   1
+#define PROTOCOL_STATUS_BAD_REQUEST 2
+#define PROTOCOL_STATUS_TABLE_ERROR 3
+#define PROTOCOL_STATUS_TIMEOUT     4
+
+void protocol_run(table_handle_type *handle, int uart_num);
+#endif
@@ -6,12 +6,126 @@
 #include "esp_log.h"
 #include "esp_spiffs.h"
 #include "esp_task_wdt.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
 #include "storage.h"
+#include "trace.h"
 
 
 #define STORAGE_BUFFER_SIZE 128
+// SPIFFS garbage collects inline once it is down to this many erased blocks
+// (spiffs_gc_check); esp_spiffs uses the 4 KB flash sector as its block
+#define STORAGE_GC_FREE_BLOCKS 3
+#define STORAGE_GC_BLOCK_SIZE 4096
 
 esp_vfs_spiffs_conf_t conf;
+storage_statistics_type storage_statistics;
+
+#ifdef CONFIG_STORAGE_FAULT_INJECTION
+uint32_t storage_fault_cut_at;    // 0: no power cut armed
+uint32_t storage_fault_writes;    // writes since storage_fault_arm()
+
+/* Simulates a power cut at the cut_at-th write from now (0 disarms). The cut
+ * is at the file level: SPIFFS itself never sees a torn page. */
+void storage_fault_arm(uint32_t cut_at)
+{
+    storage_fault_cut_at = cut_at;
+    storage_fault_writes = 0;
+}
+
+/* Called before every write. Returns true once power is cut: the write at the
+ * cut point is torn (only its first half reaches the file) and the following
+ * ones do not happen at all. */
+bool storage_fault_injected(size_t *blocksize)
+{
+    storage_fault_writes++;
+    if (0 == storage_fault_cut_at || storage_fault_writes < storage_fault_cut_at) {
+      return false;
+    }
+    *blocksize = (storage_fault_writes == storage_fault_cut_at) ? *blocksize / 2 : 0;
+    return true;
+}
+#endif
+
+/* Every rewrite of a SPIFFS page leaves the old copy deleted until GC erases its
+ * block. Account the data pages touched plus the object index page. */
+void storage_account_dirty(long offset, size_t blocksize)
+{
+    size_t first_page = offset / CONFIG_SPIFFS_PAGE_SIZE;
+    size_t last_page = (offset + blocksize + CONFIG_SPIFFS_PAGE_SIZE - 1) / CONFIG_SPIFFS_PAGE_SIZE;
+
+    storage_statistics.dirty_estimate += (last_page - first_page + 1) * CONFIG_SPIFFS_PAGE_SIZE;
+}
+
+/* One write: open, write(s), fsync and close */
+void storage_account_time(int64_t started_us)
+{
+    int64_t elapsed_us = esp_timer_get_time() - started_us;
+
+    storage_statistics.writes++;
+    storage_statistics.write_time_us += elapsed_us;
+    if (elapsed_us > storage_statistics.write_max_us) {
+      storage_statistics.write_max_us = elapsed_us;
+    }
+    if (elapsed_us > CONFIG_STORAGE_WRITE_STALL_US) {
+      storage_statistics.write_stalls++;
+    }
+}
+
+void storage_account_write(long offset, size_t blocksize, int64_t started_us)
+{
+    storage_account_dirty(offset, blocksize);
+    storage_account_time(started_us);
+}
+
+/* Traced wrappers of the stdio calls used for flash access */
+FILE* storage_fopen(char *filename, const char *mode)
+{
+    TRACE_BEGIN("open", 0);
+    FILE* f = fopen(filename, mode);
+    TRACE_END("open", 0);
+    return f;
+}
+
+bool storage_fseek(FILE* f, long offset)
+{
+    TRACE_BEGIN("seek", 0);
+    bool seek_ok = (off_t)-1!=fseek(f, offset, SEEK_SET);
+    TRACE_END("seek", 0);
+    return seek_ok;
+}
+
+size_t storage_fread(char *block, size_t blocksize, FILE* f)
+{
+    TRACE_BEGIN("read", blocksize);
+    size_t read = fread(block, 1, blocksize, f);
+    TRACE_END("read", blocksize);
+    return read;
+}
+
+size_t storage_fwrite(char *block, size_t blocksize, FILE* f)
+{
+    TRACE_BEGIN("write", blocksize);
+    size_t written = fwrite(block, 1, blocksize, f);
+    TRACE_END("write", blocksize);
+    return written;
+}
+
+void storage_fsync(FILE* f)
+{
+    TRACE_BEGIN("fsync", 0);
+    fflush(f);
+    fsync(fileno(f));
+    TRACE_END("fsync", 0);
+}
+
+int storage_fclose(FILE* f)
+{
+    TRACE_BEGIN("close", 0);
+    int ret = fclose(f);
+    TRACE_END("close", 0);
+    return ret;
+}
 
 bool storage_file_exists(char *filename)
 {
@@ -28,12 +142,31 @@ bool storage_file_exists(char *filename)
 bool storage_file_delete(char *filename)
 {
     bool deleted=false;
+    struct stat st;
     // Delete it if it exists
+    if (stat(filename, &st) == 0) {
+      storage_statistics.dirty_estimate += st.st_size;
+    }
     unlink(filename);
     ESP_LOGI(__FUNCTION__, "%s deleted", filename);
     return deleted;
 }
 
+/* SPIFFS cannot rename over an existing file: 'to' must not exist */
+bool storage_rename_file(char *from, char *to)
+{
+    bool renamed=false;
+
+    if (rename(from, to)) {
+      ESP_LOGE(__FUNCTION__, "rename %s to %s failed", from, to);
+      goto storage_rename_file_end;
+    }
+    renamed=true;
+    ESP_LOGI(__FUNCTION__, "%s renamed to %s", from, to);
+storage_rename_file_end:
+    return renamed;
+}
+
 esp_err_t storage_partition_information(size_t *total, size_t *used)
 {
     esp_err_t ret;
@@ -90,7 +223,7 @@ esp_err_t storage_init(char *partition_label, char *base_path, size_t max_files)
           goto storage_init_end;        
         }
     }
-    ESP_LOGI(__FUNCTION__, "Partition size: total: %d, used: %d", total, used);
+    ESP_LOGI(__FUNCTION__, "Partition size: total: %u, used: %u", (unsigned) total, (unsigned) used);
     // Check consistency of reported partition size info.
     if (used > total) {
         ESP_LOGW(__FUNCTION__, "Number of used bytes cannot be larger than total. Performing SPIFFS_check().");
@@ -107,13 +240,23 @@ storage_init_end:
     return ret;
 }
 
+esp_err_t storage_deinit(void)
+{
+    esp_err_t ret = esp_vfs_spiffs_unregister(conf.partition_label);
+
+    if (ret != ESP_OK) {
+      ESP_LOGE(__FUNCTION__, "Failed to unmount SPIFFS (%s)", esp_err_to_name(ret));
+    }
+    return ret;
+}
+
 bool storage_create_file(char *filename, size_t filesize) {
 
     bool write_ok = false;
     size_t written = 0;
     char buffer[STORAGE_BUFFER_SIZE];
         
-    FILE* f = fopen(filename, "wb");
+    FILE* f = storage_fopen(filename, "wb");
     if (NULL==f) {
       ESP_LOGE(__FUNCTION__, "Failed to create %s", filename);
       goto storage_write_binary_file_end;
@@ -133,19 +276,26 @@ bool storage_create_file(char *filename, size_t filesize) {
    
     while (written < filesize) {
       size_t to_write = (filesize - written > STORAGE_BUFFER_SIZE) ? STORAGE_BUFFER_SIZE : (filesize - written);
-      if (fwrite(buffer, 1, to_write, f) != to_write) {
+#ifdef CONFIG_STORAGE_FAULT_INJECTION
+      if (storage_fault_injected(&to_write)) {
+        storage_fwrite(buffer, to_write, f);
+        storage_fclose(f);
+        ESP_LOGE(__FUNCTION__, "power cut (fault injection)");
+        goto storage_write_binary_file_end;
+      }
+#endif
+      if (storage_fwrite(buffer, to_write, f) != to_write) {
         ESP_LOGE(__FUNCTION__, "Failed to write %s", filename);
-        fclose(f);
+        storage_fclose(f);
         goto storage_write_binary_file_end;
       }
       written += to_write;
     }
 
     
-    fflush(f);
-    fsync(fileno(f));
+    storage_fsync(f);
 
-    if (fclose(f)) {
+    if (storage_fclose(f)) {
       ESP_LOGE(__FUNCTION__, "Failed to close %s", filename);      
       goto storage_write_binary_file_end;
     }
@@ -166,58 +316,157 @@ bool storage_write_block_into_file(char *filename,
                                    long offset) {
 
     bool write_ok = false;
-    FILE* f = fopen(filename, "r+b");
+    int64_t started_us = esp_timer_get_time();
+    FILE* f = storage_fopen(filename, "r+b");
     if (NULL==f) {
       ESP_LOGE(__FUNCTION__, "fopen %s failed", filename);
       goto storage_write_binary_block_into_file_end;
     }
 
-    if ((off_t)-1==fseek(f, offset, SEEK_SET)) {
+    if (!storage_fseek(f, offset)) {
       ESP_LOGE(__FUNCTION__, "fseek %s failed", filename);
       goto storage_write_binary_block_into_file_end;
     }
 
-    if (blocksize!=fwrite(block, 1, blocksize, f)) {
+#ifdef CONFIG_STORAGE_FAULT_INJECTION
+    if (storage_fault_injected(&blocksize)) {
+      storage_fwrite(block, blocksize, f);
+      storage_fclose(f);
+      ESP_LOGE(__FUNCTION__, "power cut (fault injection)");
+      goto storage_write_binary_block_into_file_end;
+    }
+#endif
+    if (blocksize!=storage_fwrite(block, blocksize, f)) {
       ESP_LOGE(__FUNCTION__, "fwrite %s failed", filename);
-      fclose(f);
+      storage_fclose(f);
       goto storage_write_binary_block_into_file_end;
     }
-    fflush(f);
-    fsync(fileno(f));
-    if (fclose(f)) {
+    storage_fsync(f);
+    if (storage_fclose(f)) {
       ESP_LOGE(__FUNCTION__, "close %s failed", filename);      
       goto storage_write_binary_block_into_file_end;
     }  
     write_ok=true;
+    storage_account_write(offset, blocksize, started_us);
     ESP_LOGI(__FUNCTION__, "ok");
 storage_write_binary_block_into_file_end:
   return write_ok;
 }
 
 
+/* Appends a block at the end of the file, creating it if needed */
+bool storage_append_block_to_file(char *filename,
+                                  char *block,
+                                  size_t blocksize) {
+
+    bool write_ok = false;
+    int64_t started_us = esp_timer_get_time();
+    long offset;
+    FILE* f = storage_fopen(filename, "ab");
+    if (NULL==f) {
+      ESP_LOGE(__FUNCTION__, "fopen %s failed", filename);
+      goto storage_append_block_to_file_end;
+    }
+    offset = ftell(f);
+
+#ifdef CONFIG_STORAGE_FAULT_INJECTION
+    if (storage_fault_injected(&blocksize)) {
+      storage_fwrite(block, blocksize, f);
+      storage_fclose(f);
+      ESP_LOGE(__FUNCTION__, "power cut (fault injection)");
+      goto storage_append_block_to_file_end;
+    }
+#endif
+    if (blocksize!=storage_fwrite(block, blocksize, f)) {
+      ESP_LOGE(__FUNCTION__, "fwrite %s failed", filename);
+      storage_fclose(f);
+      goto storage_append_block_to_file_end;
+    }
+    storage_fsync(f);
+    if (storage_fclose(f)) {
+      ESP_LOGE(__FUNCTION__, "close %s failed", filename);
+      goto storage_append_block_to_file_end;
+    }
+    write_ok=true;
+    storage_account_write(offset, blocksize, started_us);
+storage_append_block_to_file_end:
+  return write_ok;
+}
+
+/* Writes several small blocks of the same file with a single open and fsync,
+ * so that only the flash pages holding them are rewritten. */
+bool storage_write_segments_into_file(char *filename,
+                                      storage_segment_type *segments,
+                                      size_t segments_count) {
+
+    bool write_ok = false;
+    int64_t started_us = esp_timer_get_time();
+    FILE* f = storage_fopen(filename, "r+b");
+    if (NULL==f) {
+      ESP_LOGE(__FUNCTION__, "fopen %s failed", filename);
+      goto storage_write_segments_into_file_end;
+    }
+
+    for (size_t i=0; i<segments_count; i++) {
+      if (!storage_fseek(f, segments[i].offset)) {
+        ESP_LOGE(__FUNCTION__, "fseek %s failed", filename);
+        storage_fclose(f);
+        goto storage_write_segments_into_file_end;
+      }
+#ifdef CONFIG_STORAGE_FAULT_INJECTION
+      size_t torn = segments[i].blocksize;
+
+      if (storage_fault_injected(&torn)) {
+        storage_fwrite(segments[i].block, torn, f);
+        storage_fclose(f);
+        ESP_LOGE(__FUNCTION__, "power cut (fault injection)");
+        goto storage_write_segments_into_file_end;
+      }
+#endif
+      if (segments[i].blocksize!=storage_fwrite(segments[i].block, segments[i].blocksize, f)) {
+        ESP_LOGE(__FUNCTION__, "fwrite %s failed", filename);
+        storage_fclose(f);
+        goto storage_write_segments_into_file_end;
+      }
+    }
+    storage_fsync(f);
+    if (storage_fclose(f)) {
+      ESP_LOGE(__FUNCTION__, "close %s failed", filename);      
+      goto storage_write_segments_into_file_end;
+    }  
+    for (size_t i=0; i<segments_count; i++) {
+      storage_account_dirty(segments[i].offset, segments[i].blocksize);
+    }
+    storage_account_time(started_us);
+    write_ok=true;
+storage_write_segments_into_file_end:
+  return write_ok;
+}
+
+
 bool storage_read_block_from_file(char *filename,
                                   char *block,  
                                   size_t blocksize, 
                                   long offset) {
 
     bool read_ok = false;
-    FILE* f = fopen(filename, "r+b");
+    FILE* f = storage_fopen(filename, "r+b");
     if (NULL==f) {
       ESP_LOGE(__FUNCTION__, "Failed to open %s for reading", filename);
       goto storage_read_block_from_file_end;
     }
 
-    if ((off_t)-1==fseek(f, offset, SEEK_SET)) {
+    if (!storage_fseek(f, offset)) {
       ESP_LOGE(__FUNCTION__, "fseek %s failed", filename);
       goto storage_read_block_from_file_end;
     }
 
-    if (blocksize!=fread(block, 1, blocksize, f)) {
+    if (blocksize!=storage_fread(block, blocksize, f)) {
       ESP_LOGE(__FUNCTION__, "Failed to read %s", filename);
-      fclose(f);
+      storage_fclose(f);
       goto storage_read_block_from_file_end;
     }
-    if (fclose(f)) {
+    if (storage_fclose(f)) {
       ESP_LOGE(__FUNCTION__, "Failed to close %s", filename);      
       goto storage_read_block_from_file_end;
     }
@@ -230,22 +479,91 @@ storage_read_block_from_file_end:
 bool storage_read_file(char *filename, char *filedata, size_t filesize) {
 
     bool read_ok = false;
-    FILE* f = fopen(filename, "r+b");
+    FILE* f = storage_fopen(filename, "r+b");
     if (NULL==f) {
       ESP_LOGE(__FUNCTION__, "Failed to open %s for reading", filename);
       goto storage_read_binary_file_end;
     }
 
-    if (filesize!=fread(filedata, 1, filesize, f)) {
+    if (filesize!=storage_fread(filedata, filesize, f)) {
       ESP_LOGE(__FUNCTION__, "Failed to read %s", filename);
-      fclose(f);
+      storage_fclose(f);
       goto storage_read_binary_file_end;
     }
-    if (fclose(f)) {
+    if (storage_fclose(f)) {
       ESP_LOGE(__FUNCTION__, "Failed to close %s", filename);      
       goto storage_read_binary_file_end;
     }
     read_ok=true;
 storage_read_binary_file_end:
   return read_ok;
-}
\ No newline at end of file
+}
+
+/* Reclaims deleted pages in bounded slices while the application is idle, so
+ * that writes find erased pages and SPIFFS does not need to run GC inline.
+ * Call it from the main loop or a low-priority task. SPIFFS does not report
+ * deleted pages, so the amount to reclaim is estimated from the writes done
+ * since the last GC. SPIFFS ignores GC requests while it has plenty of erased
+ * blocks, so the call is only made once the erased space left could not take
+ * another CONFIG_STORAGE_IDLE_GC_DIRTY_KB of writes without inline GC; the
+ * estimate is kept meanwhile. */
+esp_err_t storage_maintenance(void)
+{
+    esp_err_t ret = ESP_OK;
+#ifdef CONFIG_STORAGE_IDLE_GC
+    size_t total, used;
+    size_t slice, clean;
+    int64_t started_us, elapsed_us;
+
+    if (storage_statistics.dirty_estimate < CONFIG_STORAGE_IDLE_GC_DIRTY_KB * 1024) {
+      goto storage_maintenance_end;
+    }
+    ret = esp_spiffs_info(conf.partition_label, &total, &used);
+    if (ret != ESP_OK) {
+      ESP_LOGE(__FUNCTION__, "esp_spiffs_info failed (%s)", esp_err_to_name(ret));
+      goto storage_maintenance_end;
+    }
+    if (storage_statistics.dirty_estimate > total - used) {
+      storage_statistics.dirty_estimate = total - used;
+    }
+    // esp_spiffs_gc() erases blocks until 'clean + slice' bytes are free
+    clean = total - used - storage_statistics.dirty_estimate;
+    slice = storage_statistics.dirty_estimate;
+    if (slice > CONFIG_STORAGE_IDLE_GC_SLICE_KB * 1024) {
+      slice = CONFIG_STORAGE_IDLE_GC_SLICE_KB * 1024;
+    }
+    if (clean > STORAGE_GC_FREE_BLOCKS * STORAGE_GC_BLOCK_SIZE + CONFIG_STORAGE_IDLE_GC_DIRTY_KB * 1024) {
+      // SPIFFS would return without erasing anything
+      storage_statistics.gc_skipped++;
+      goto storage_maintenance_end;
+    }
+
+    started_us = esp_timer_get_time();
+    TRACE_BEGIN("gc", clean + slice);
+    ret = esp_spiffs_gc(conf.partition_label, clean + slice);
+    TRACE_END("gc", clean + slice);
+    elapsed_us = esp_timer_get_time() - started_us;
+
+    storage_statistics.gc_slices++;
+    storage_statistics.gc_time_us += elapsed_us;
+    if (elapsed_us > storage_statistics.gc_max_us) {
+      storage_statistics.gc_max_us = elapsed_us;
+    }
+    if (ret != ESP_OK) {
+      // nothing left to reclaim (or GC gave up): start estimating again from zero
+      ESP_LOGD(__FUNCTION__, "esp_spiffs_gc: %s", esp_err_to_name(ret));
+      storage_statistics.gc_failures++;
+      storage_statistics.dirty_estimate = 0;
+      ret = ESP_OK;
+      goto storage_maintenance_end;
+    }
+    storage_statistics.dirty_estimate -= slice;
+storage_maintenance_end:
+#endif
+    return ret;
+}
+
+void storage_get_statistics(storage_statistics_type *statistics)
+{
+    *statistics = storage_statistics;
+}
@@ -3,8 +3,30 @@
 
 #define STORAGE_VERSION 1
 
+typedef struct {
+  char *block;
+  size_t blocksize;
+  long offset;
+} storage_segment_type;
+
+typedef struct {
+  uint32_t writes;             // write calls (each one open/write(s)/fsync/close)
+  uint32_t write_stalls;       // writes slower than CONFIG_STORAGE_WRITE_STALL_US
+  int64_t write_time_us;       // total time spent in writes
+  int64_t write_max_us;        // slowest write
+  size_t dirty_estimate;       // bytes of deleted pages not yet reclaimed (estimate)
+  uint32_t gc_slices;          // idle GC calls made by storage_maintenance
+  uint32_t gc_skipped;         // idle GC passes skipped while erased space was plentiful
+  uint32_t gc_failures;
+  int64_t gc_time_us;          // total time spent in idle GC
+  int64_t gc_max_us;           // longest idle GC slice
+} storage_statistics_type;
 
 esp_err_t storage_init(char *partition_label, char *base_path, size_t max_files);
+esp_err_t storage_deinit(void);
+bool storage_file_delete(char *filename);
+bool storage_file_exists(char *filename);
+bool storage_rename_file(char *from, char *to);
 bool storage_create_file(char *filename, size_t filesize);
 bool storage_read_binary_file(char *filename, char *filedata, size_t filesize);
 esp_err_t storage_partition_information(size_t *total, size_t *used);
@@ -16,6 +38,17 @@ bool storage_read_block_from_file(char *filename,
                                   char *block,  
                                   size_t blocksize, 
                                   long offset);                                   
+bool storage_append_block_to_file(char *filename,
+                                   char *block,
+                                   size_t blocksize);
+bool storage_write_segments_into_file(char *filename,
+                                      storage_segment_type *segments,
+                                      size_t segments_count);
+esp_err_t storage_maintenance(void);
+void storage_get_statistics(storage_statistics_type *statistics);
+
+// only available with CONFIG_STORAGE_FAULT_INJECTION
+void storage_fault_arm(uint32_t cut_at);
 
 void storage_test();
 #endif
\ No newline at end of file
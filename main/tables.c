@@ -2,39 +2,191 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_spiffs.h"
+#include "esp_rom_crc.h"
+#include "esp_random.h"
+#include "sdkconfig.h"
 #include "storage.h"
 #include "tables.h"
+#include "trace.h"
+
+#ifdef CONFIG_TABLE_RECORD_CRC
+#define TABLE_RECORD_CRC_SIZE sizeof(uint32_t)
+#else
+#define TABLE_RECORD_CRC_SIZE 0
+#endif
 
 /* Prototypes of private funcs*/
 bool table_read_file_header(table_handle_type *handle,
                             table_header_type *table_header);
 bool table_write_file_header(table_handle_type *handle,
                              table_header_type *table_header);
+long table_record_offset(table_handle_type *handle, uint16_t index);
+void table_record_seal(table_handle_type *handle, char *record);
+bool table_record_verify(table_handle_type *handle, char *record);
+bool table_write_record(table_handle_type *handle, uint16_t index);
+bool table_read_record(table_handle_type *handle, uint16_t index, char *record);
+void table_lock(table_handle_type *handle);
+void table_unlock(table_handle_type *handle);
+void table_field_encode(char *raw, const table_field_type *field, int64_t value);
+bool table_read_range_callback(const char *record, uint16_t index, void *ctx);
+bool table_meta_open(table_handle_type *handle);
+bool table_sort_records(table_handle_type *handle,
+                        table_comparator_type comparator,
+                        char *scratch,
+                        size_t scratch_size,
+                        bool dedup);
+bool table_meta_write(table_handle_type *handle, uint16_t used_records);
+bool table_meta_init(table_handle_type *handle);
+bool table_meta_stamp_read(table_handle_type *handle, table_stamp_type *stamp);
+bool table_meta_stamp_write(table_handle_type *handle, char *path, uint32_t sequence, uint16_t used_records);
+bool table_meta_refresh_file(table_handle_type *handle);
+bool table_scan(table_handle_type *handle,
+                uint16_t from,
+                uint16_t to,
+                table_scan_callback_type callback,
+                void *ctx);
+bool table_select_callback(const char *record, uint16_t index, void *ctx);
+bool table_aggregate_callback(const char *record, uint16_t index, void *ctx);
+bool table_zone_write_header(table_handle_type *handle, uint16_t used_records);
+bool table_zone_update(table_handle_type *handle, uint16_t index, int64_t value, bool reset);
+bool table_zone_rebuild_callback(const char *record, uint16_t index, void *ctx);
+bool table_zone_rebuild(table_handle_type *handle, uint16_t from);
+bool table_range_predicate(const char *record, void *arg);
+bool table_snapshot_preserve(table_handle_type *handle, uint16_t from, uint16_t to);
+void table_snapshot_take(table_handle_type *handle);
+bool table_snapshot_dirty(table_handle_type *handle, uint16_t index);
+void table_snapshot_mark(table_handle_type *handle, uint16_t index);
+bool table_snapshot_read_records(table_handle_type *handle, uint16_t from, uint16_t count, char *records);
+bool table_export_delta_freeze(table_handle_type *handle,
+                               uint32_t since_snapshot,
+                               uint8_t *changed,
+                               uint32_t *snapshot_id,
+                               uint16_t *used_records,
+                               bool *full);
 /* End of prototypes of private funcs*/
 
+void table_lock(table_handle_type *handle) {
+  if (handle->lock != NULL) {
+    xSemaphoreTakeRecursive(handle->lock, portMAX_DELAY);
+  }
+}
+
+void table_unlock(table_handle_type *handle) {
+  if (handle->lock != NULL) {
+    xSemaphoreGiveRecursive(handle->lock);
+  }
+}
+
+long table_record_offset(table_handle_type *handle, uint16_t index) {
+  return TABLE_OFFSET_RECORDS+(long)index*handle->record_size;
+}
+
+/* Stores the CRC of the user data at the end of the record (no-op without CRC) */
+void table_record_seal(table_handle_type *handle, char *record) {
+#ifdef CONFIG_TABLE_RECORD_CRC
+  uint32_t crc = esp_rom_crc32_le(0, (uint8_t*) record, handle->user_data_size);
+  memcpy(record+handle->user_data_size, &crc, TABLE_RECORD_CRC_SIZE);
+#endif
+}
+
+bool table_record_verify(table_handle_type *handle, char *record) {
+#ifdef CONFIG_TABLE_RECORD_CRC
+  uint32_t crc;
+  memcpy(&crc, record+handle->user_data_size, TABLE_RECORD_CRC_SIZE);
+  return crc==esp_rom_crc32_le(0, (uint8_t*) record, handle->user_data_size);
+#else
+  return true;
+#endif
+}
+
+/* Writes handle->user_data (and its CRC) into the record slot at index */
+bool table_write_record(table_handle_type *handle, uint16_t index) {
+
+  bool write_ok = false;
+  char *record = handle->user_data;
+
+  if (handle->record_size!=handle->user_data_size) {
+    record=malloc(handle->record_size);
+    if (record == NULL) {
+      ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+      goto table_write_record_end;
+    }
+    memcpy(record, handle->user_data, handle->user_data_size);
+    table_record_seal(handle, record);
+  }
+
+  if (!storage_write_block_into_file(handle->path,
+                                     record,
+                                     handle->record_size,
+                                     table_record_offset(handle, index))) {
+    ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+    goto table_write_record_end;
+  }
+  write_ok = true;
+table_write_record_end:
+  if (record != NULL && record != handle->user_data) {
+    free(record);
+  }
+  return write_ok;
+}
+
+/* Reads the whole record slot at index into record and checks its CRC */
+bool table_read_record(table_handle_type *handle, uint16_t index, char *record) {
+
+  bool read_ok = false;
+
+  if (!storage_read_block_from_file(handle->path,
+                                    record,
+                                    handle->record_size,
+                                    table_record_offset(handle, index))) {
+    ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+    goto table_read_record_end;
+  }
+  if (!table_record_verify(handle, record)) {
+    ESP_LOGE(__FUNCTION__, "record %d corrupted (CRC mismatch)", index);
+    goto table_read_record_end;
+  }
+  read_ok=true;
+table_read_record_end:
+  return read_ok;
+}
+
 
 
 bool table_clean(table_handle_type *handle) {
   
   bool clean_ok=false;
   
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, sizeof(table_header_type));
   if (handle->used_records>0) {
     table_header_type table_header;
     
+    if (!table_snapshot_preserve(handle, 0, handle->used_records)) {
+      ESP_LOGE(__FUNCTION__, "table_snapshot_preserve failed");
+      goto table_clean_end;
+    }
     table_header.used_records=0;
     if (!table_write_file_header(handle, &table_header)) {
       ESP_LOGE(__FUNCTION__, "table_write_file_header failed");
       goto table_clean_end;
     }
     handle->used_records=0;
+    if (handle->zone_path != NULL && !table_zone_write_header(handle, 0)) {
+      ESP_LOGE(__FUNCTION__, "table_zone_write_header failed");
+      goto table_clean_end;
+    }
   }
   clean_ok=true;
 table_clean_end:
+  TRACE_END(__FUNCTION__, sizeof(table_header_type));
+  table_unlock(handle);
   return clean_ok;
 }
 
@@ -43,6 +195,8 @@ bool table_count(table_handle_type *handle) {
   bool read_ok=false;
   table_header_type table_header;
   
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, sizeof(table_header_type));
   if (!table_read_file_header(handle, &table_header)) {
     ESP_LOGE(__FUNCTION__, "table_read_file_header failed");
     goto table_count_end;
@@ -50,6 +204,8 @@ bool table_count(table_handle_type *handle) {
   handle->used_records=table_header.used_records;
   read_ok=true;
 table_count_end:
+  TRACE_END(__FUNCTION__, sizeof(table_header_type));
+  table_unlock(handle);
   return read_ok;
 }
 
@@ -62,16 +218,47 @@ bool table_init (table_handle_type *handle,
   struct stat st; 
   bool init_ok = false;
  
+  TRACE_BEGIN(__FUNCTION__, sizeof(table_header_type));
+  handle->lock=xSemaphoreCreateRecursiveMutex();
+  if (handle->lock == NULL) {
+    ESP_LOGE(__FUNCTION__, "Could not create table lock");
+    goto table_init_end;
+  }
   handle->path=path;
   handle->user_data=user_data;
   handle->user_data_size=user_data_size;
+  handle->record_size=user_data_size+TABLE_RECORD_CRC_SIZE;
   handle->capacity=capacity;
+  handle->used_records=0;
+  handle->scrub_cursor=0;
+  handle->sequence=0;
+  handle->zone_path=NULL;
+  handle->zones=NULL;
+  handle->snapshot_path=NULL;
+  handle->snapshot_id=0;
+
+#ifdef CONFIG_TABLE_META_IN_NVS
+  if (!table_meta_open(handle)) {
+    ESP_LOGE(__FUNCTION__, "table_meta_open failed");
+    goto table_init_end;
+  }
+#endif
+
+  if (0!=stat(path, &st)) {
+    char new_path[TABLE_PATH_MAX];
 
+    // table_sort replaces the table by deleting it and renaming the new file
+    snprintf(new_path, sizeof(new_path), "%s.new", path);
+    if (storage_file_exists(new_path)) {
+      ESP_LOGW(__FUNCTION__, "%s not found, recovering %s", path, new_path);
+      storage_rename_file(new_path, path);
+    }
+  }
   if (0!=stat(path, &st)) {
     ESP_LOGI(__FUNCTION__, "%s not found, will create...", path);
 
     size_t file_size = sizeof(table_header_type) +
-    handle->capacity * handle->user_data_size;
+    handle->capacity * handle->record_size;
  
     if (!storage_create_file(handle->path, file_size)) {
       ESP_LOGE(__FUNCTION__, "storage_create_file failed");
@@ -82,41 +269,93 @@ bool table_init (table_handle_type *handle,
       ESP_LOGE(__FUNCTION__, "table_clean failed");
       goto table_init_end;
     }
+#ifdef CONFIG_TABLE_META_IN_NVS
+    if (!table_meta_write(handle, 0)) {
+      ESP_LOGE(__FUNCTION__, "table_meta_write failed");
+      goto table_init_end;
+    }
+    if (!table_meta_refresh_file(handle)) {
+      ESP_LOGE(__FUNCTION__, "table_meta_refresh_file failed");
+      goto table_init_end;
+    }
+#endif
   }
   else {    
+    size_t file_size = sizeof(table_header_type) +
+    handle->capacity * handle->record_size;
+
+    // a different record CRC setting or capacity changes the file layout
+    if ((size_t)st.st_size!=file_size &&
+        (size_t)st.st_size!=file_size+sizeof(table_stamp_type)) {
+      ESP_LOGE(__FUNCTION__, "%s has %ld bytes, %u expected: layout changed, recreate the table",
+               path, (long)st.st_size, (unsigned)file_size);
+      goto table_init_end;
+    }
+#ifdef CONFIG_TABLE_META_IN_NVS
+    if (!table_meta_init(handle)) {
+      ESP_LOGE(__FUNCTION__, "table_meta_init failed");
+      goto table_init_end;
+    }
+#else
     if (!table_count(handle)) {
       ESP_LOGE(__FUNCTION__, "table_count failed");
       goto table_init_end;
     }    
+#endif
     ESP_LOGI(__FUNCTION__, "%s found, %d records used", 
     handle->path, handle->used_records);
   }
   init_ok = true;
 table_init_end:  
+  TRACE_END(__FUNCTION__, sizeof(table_header_type));
   return init_ok;
 }
 
+/* Releases the resources taken by table_init; the table file is untouched */
+void table_deinit(table_handle_type *handle) {
+#ifdef CONFIG_TABLE_META_IN_NVS
+  nvs_close(handle->meta_nvs);
+#endif
+  if (handle->lock != NULL) {
+    vSemaphoreDelete(handle->lock);
+    handle->lock=NULL;
+  }
+  handle->zone_path=NULL;
+  handle->snapshot_path=NULL;
+}
+
 bool table_append(table_handle_type *handle) {
 
   bool write_ok = false;
   table_header_type table_header;
   
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, handle->record_size);
   if (handle->used_records>=handle->capacity) {
     ESP_LOGE(__FUNCTION__, "Out of space");
     goto table_append_end;
   }
-  uint16_t offset=TABLE_OFFSET_RECORDS+handle->used_records*handle->user_data_size;
+  if (!table_snapshot_preserve(handle, handle->used_records, handle->used_records+1)) {
+    ESP_LOGE(__FUNCTION__, "table_snapshot_preserve failed");
+    goto table_append_end;
+  }
+  long offset=table_record_offset(handle, handle->used_records);
   
-  if (!storage_write_block_into_file(handle->path, 
-                                     (char*) handle->user_data,         // buffer
-                                     handle->user_data_size,            // buffer size
-                                     offset
-                                     )) {
-    ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+  if (handle->zone_path != NULL &&
+      !table_zone_update(handle,
+                         handle->used_records,
+                         table_field_value(handle->user_data, &handle->zone_field),
+                         0==handle->used_records%handle->zone_records)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_update failed");
     goto table_append_end;
   }
 
-  ESP_LOGI(__FUNCTION__, "offset: %d, data: %.*s", offset, 
+  if (!table_write_record(handle, handle->used_records)) {
+    ESP_LOGE(__FUNCTION__, "table_write_record failed");
+    goto table_append_end;
+  }
+
+  ESP_LOGI(__FUNCTION__, "offset: %ld, data: %.*s", offset, 
   handle->user_data_size, handle->user_data);
   table_header.used_records=handle->used_records+1;
   if (!table_write_file_header(handle, &table_header)) {
@@ -125,15 +364,154 @@ bool table_append(table_handle_type *handle) {
   }
   
   handle->used_records=handle->used_records+1;
+  if (handle->zone_path != NULL && !table_zone_write_header(handle, handle->used_records)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_write_header failed");
+    goto table_append_end;
+  }
   write_ok=true;
 table_append_end:
+  TRACE_END(__FUNCTION__, handle->record_size);
+  table_unlock(handle);
+  return write_ok;
+}
+
+/* Appends count records (packed user data) with a single write of the record
+ * area, one zone map update and one header write. */
+bool table_append_many(table_handle_type *handle, const char *records, uint16_t count) {
+
+  bool write_ok = false;
+  table_header_type table_header;
+  char *ptr = (char*) records;
+  uint16_t first;
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, (uint32_t)count*handle->record_size);
+  first=handle->used_records;
+  if (count>handle->capacity-handle->used_records) {
+    ESP_LOGE(__FUNCTION__, "Out of space");
+    goto table_append_many_end;
+  }
+  if (0==count) {
+    write_ok=true;
+    goto table_append_many_end;
+  }
+  if (!table_snapshot_preserve(handle, first, first+count)) {
+    ESP_LOGE(__FUNCTION__, "table_snapshot_preserve failed");
+    goto table_append_many_end;
+  }
+
+  if (handle->record_size!=handle->user_data_size) {
+    ptr=malloc((size_t)count*handle->record_size);
+    if (ptr == NULL) {
+      ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+      goto table_append_many_end;
+    }
+    for (uint16_t i=0; i<count; i++) {
+      char *record = ptr+(size_t)i*handle->record_size;
+
+      memcpy(record, records+(size_t)i*handle->user_data_size, handle->user_data_size);
+      table_record_seal(handle, record);
+    }
+  }
+
+  if (handle->zone_path != NULL) {
+    uint16_t first_zone = first/handle->zone_records;
+    uint16_t last_zone = (first+count-1)/handle->zone_records;
+
+    // widen the zones before the records are written, as table_append does
+    for (uint16_t i=0; i<count; i++) {
+      table_zone_rebuild_callback(records+(size_t)i*handle->user_data_size, first+i, handle);
+    }
+    if (!storage_write_block_into_file(handle->zone_path,
+                                       (char*) &handle->zones[first_zone],
+                                       (last_zone-first_zone+1)*sizeof(table_zone_type),
+                                       TABLE_OFFSET_ZONES+first_zone*sizeof(table_zone_type))) {
+      ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+      goto table_append_many_end;
+    }
+  }
+
+  if (!storage_write_block_into_file(handle->path,
+                                     ptr,
+                                     (size_t)count*handle->record_size,
+                                     table_record_offset(handle, first))) {
+    ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+    goto table_append_many_end;
+  }
+
+  table_header.used_records=first+count;
+  if (!table_write_file_header(handle, &table_header)) {
+    ESP_LOGE(__FUNCTION__, "table_write_file_header failed");
+    goto table_append_many_end;
+  }
+  handle->used_records=first+count;
+  if (handle->zone_path != NULL && !table_zone_write_header(handle, handle->used_records)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_write_header failed");
+    goto table_append_many_end;
+  }
+  write_ok=true;
+table_append_many_end:
+  if (ptr != NULL && ptr != records) {
+    free(ptr);
+  }
+  TRACE_END(__FUNCTION__, (uint32_t)count*handle->record_size);
+  table_unlock(handle);
   return write_ok;
 }
 
+typedef struct {
+  char *out;
+  uint16_t from;
+  uint16_t user_data_size;
+} table_read_range_context_type;
+
+bool table_read_range_callback(const char *record, uint16_t index, void *ctx) {
+
+  table_read_range_context_type *range = ctx;
+
+  memcpy(range->out+(size_t)(index-range->from)*range->user_data_size,
+         record,
+         range->user_data_size);
+  return true;
+}
+
+/* Copies the user data of records [from, from+count) into out, packed */
+bool table_read_range(table_handle_type *handle, uint16_t from, uint16_t count, char *out) {
+
+  bool read_ok = false;
+  table_read_range_context_type range = {
+    .out = out,
+    .from = from,
+    .user_data_size = handle->user_data_size,
+  };
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, (uint32_t)count*handle->record_size);
+  if (from>handle->used_records || count>handle->used_records-from) {
+    ESP_LOGE(__FUNCTION__, "records not available");
+    goto table_read_range_end;
+  }
+  if (!table_scan(handle, from, from+count, table_read_range_callback, &range)) {
+    ESP_LOGE(__FUNCTION__, "table_scan failed");
+    goto table_read_range_end;
+  }
+  read_ok=true;
+table_read_range_end:
+  TRACE_END(__FUNCTION__, (uint32_t)count*handle->record_size);
+  table_unlock(handle);
+  return read_ok;
+}
+
 bool table_read_file_header(table_handle_type *handle,
                             table_header_type *table_header) {
   bool read_ok = false;
    
+#ifdef CONFIG_TABLE_META_IN_NVS
+  // the record count lives in NVS, the file header is only refreshed at init
+  table_header->used_records=handle->used_records;
+  read_ok=true;
+  goto table_read_file_header_end;
+#endif
   if (!storage_read_block_from_file(handle->path, 
                                     (char*) table_header, 
                                     sizeof(table_header_type),
@@ -150,6 +528,10 @@ bool table_write_file_header(table_handle_type *handle,
                              table_header_type *table_header) {
   bool write_ok = false;
   
+#ifdef CONFIG_TABLE_META_IN_NVS
+  write_ok=table_meta_write(handle, table_header->used_records);
+  goto table_write_file_header_end;
+#endif
   if (!storage_write_block_into_file(handle->path, 
                                      (char*) table_header, 
                                      sizeof(table_header_type),
@@ -166,19 +548,32 @@ table_write_file_header_end:
 bool table_read_index(table_handle_type *handle,
                              uint16_t index) {
   bool read_ok = false;
+  char *record = handle->user_data;
   
-  uint16_t offset=TABLE_OFFSET_RECORDS+index*handle->user_data_size;
-  
-  if (!storage_read_block_from_file(handle->path, 
-                                    (char*) handle->user_data,
-                                    handle->user_data_size,
-                                    TABLE_OFFSET_FILE_HEADER+
-                                    offset)) {
-    ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, handle->record_size);
+  if (handle->record_size!=handle->user_data_size) {
+    record=malloc(handle->record_size);
+    if (record == NULL) {
+      ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+      goto table_read_record_index_end;
+    }
+  }
+
+  if (!table_read_record(handle, index, record)) {
+    ESP_LOGE(__FUNCTION__, "table_read_record failed");
     goto table_read_record_index_end;                                            
   }
+  if (record != handle->user_data) {
+    memcpy(handle->user_data, record, handle->user_data_size);
+  }
   read_ok=true;
 table_read_record_index_end:
+  if (record != NULL && record != handle->user_data) {
+    free(record);
+  }
+  TRACE_END(__FUNCTION__, handle->record_size);
+  table_unlock(handle);
   return read_ok;
 }
 
@@ -187,7 +582,11 @@ bool table_delete_index(table_handle_type *handle, uint16_t index) {
   bool delete_ok = false;
   table_header_type table_header;
   void *ptr = NULL;
+  uint32_t traced;          // bytes of the tail shifted up
   
+  table_lock(handle);
+  traced=(index<handle->used_records) ? (uint32_t)(handle->used_records-index-1)*handle->record_size : 0;
+  TRACE_BEGIN(__FUNCTION__, traced);
   if (0==handle->used_records) {
     ESP_LOGE(__FUNCTION__, "empty table");
     goto table_delete_record_index_end;
@@ -197,11 +596,16 @@ bool table_delete_index(table_handle_type *handle, uint16_t index) {
     ESP_LOGE(__FUNCTION__, "record not available");
     goto table_delete_record_index_end;
   }
+  // the records below index move up, the last slot is left behind
+  if (!table_snapshot_preserve(handle, index, handle->used_records)) {
+    ESP_LOGE(__FUNCTION__, "table_snapshot_preserve failed");
+    goto table_delete_record_index_end;
+  }
   
   if (index<handle->used_records-1) {    
-    uint16_t buffer_below = handle->user_data_size*(handle->used_records-index-1);  
-    uint16_t offset_below = TABLE_OFFSET_RECORDS+(index+1)*handle->user_data_size;  
-    uint16_t offset_new = offset_below-handle->user_data_size;
+    size_t buffer_below = (size_t)handle->record_size*(handle->used_records-index-1);  
+    long offset_below = table_record_offset(handle, index+1);  
+    long offset_new = offset_below-handle->record_size;
      
     ptr=malloc(buffer_below);
    
@@ -233,11 +637,17 @@ bool table_delete_index(table_handle_type *handle, uint16_t index) {
     goto table_delete_record_index_end;
   }
   handle->used_records=handle->used_records-1; 
+  if (handle->zone_path != NULL && !table_zone_rebuild(handle, index)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_rebuild failed");
+    goto table_delete_record_index_end;
+  }
   delete_ok = true;
 table_delete_record_index_end:
   if (ptr != NULL) {
     free(ptr);
   }
+  TRACE_END(__FUNCTION__, traced);
+  table_unlock(handle);
   return delete_ok;
 }
 
@@ -247,6 +657,8 @@ bool table_replace_index(table_handle_type *handle,
   bool replace_ok=false;
   
   
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, handle->record_size);
   if (0==handle->used_records) {
     ESP_LOGE(__FUNCTION__, "empty table");
     goto table_replace_index_end;
@@ -256,19 +668,29 @@ bool table_replace_index(table_handle_type *handle,
     ESP_LOGE(__FUNCTION__, "record not available");
     goto table_replace_index_end;
   }
+  if (!table_snapshot_preserve(handle, index, index+1)) {
+    ESP_LOGE(__FUNCTION__, "table_snapshot_preserve failed");
+    goto table_replace_index_end;
+  }
   
-  uint16_t offset=TABLE_OFFSET_RECORDS+index*handle->user_data_size;
-  
-  if (!storage_write_block_into_file(handle->path, 
-                                    handle->user_data,
-                                    handle->user_data_size,
-                                    offset)) {
-    ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+  if (handle->zone_path != NULL &&
+      !table_zone_update(handle,
+                         index,
+                         table_field_value(handle->user_data, &handle->zone_field),
+                         false)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_update failed");
+    goto table_replace_index_end;
+  }
+
+  if (!table_write_record(handle, index)) {
+    ESP_LOGE(__FUNCTION__, "table_write_record failed");
     goto table_replace_index_end;                                            
   }
   replace_ok = true;
 table_replace_index_end:
   
+  TRACE_END(__FUNCTION__, handle->record_size);
+  table_unlock(handle);
   return replace_ok;
 }
 
@@ -279,9 +701,14 @@ bool table_insert_index(table_handle_type *handle, uint16_t index) {
   bool insert_ok = false;
   table_header_type table_header;
   void *ptr = NULL;
+  uint32_t traced;          // bytes of the new record and the tail shifted down
   
+  table_lock(handle);
+  traced=(index<=handle->used_records) ? (uint32_t)(handle->used_records-index+1)*handle->record_size : 0;
+  TRACE_BEGIN(__FUNCTION__, traced);
   if (index == handle->used_records) {
-    return table_append(handle); 
+    insert_ok = table_append(handle); 
+    goto table_insert_index_end;
   }
   if (index > handle->used_records) {
     ESP_LOGE(__FUNCTION__, "wrong index %d", index);
@@ -291,9 +718,13 @@ bool table_insert_index(table_handle_type *handle, uint16_t index) {
     ESP_LOGE(__FUNCTION__, "Out of space");
     goto table_insert_index_end;
   }
+  if (!table_snapshot_preserve(handle, index, handle->used_records+1)) {
+    ESP_LOGE(__FUNCTION__, "table_snapshot_preserve failed");
+    goto table_insert_index_end;
+  }
   
-  uint16_t buffer_size = handle->user_data_size*(handle->used_records-index+1);  
-  uint16_t offset = TABLE_OFFSET_RECORDS+index*handle->user_data_size;  
+  size_t buffer_size = (size_t)handle->record_size*(handle->used_records-index+1);  
+  long offset = table_record_offset(handle, index);  
   
    
   ptr=malloc(buffer_size);
@@ -304,14 +735,15 @@ bool table_insert_index(table_handle_type *handle, uint16_t index) {
   }
   
   if (!storage_read_block_from_file(handle->path, 
-                                    (char*) ptr+handle->user_data_size,
-                                    buffer_size-handle->user_data_size,
+                                    (char*) ptr+handle->record_size,
+                                    buffer_size-handle->record_size,
                                     offset)) {
     ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
     goto table_insert_index_end;                                            
   }
 
   memcpy(ptr, handle->user_data, handle->user_data_size);
+  table_record_seal(handle, (char*) ptr);
   
   if (!storage_write_block_into_file(handle->path, 
                                     (char*) ptr,
@@ -328,10 +760,1687 @@ bool table_insert_index(table_handle_type *handle, uint16_t index) {
     goto table_insert_index_end;
   }
   handle->used_records=handle->used_records+1; 
+  if (handle->zone_path != NULL && !table_zone_rebuild(handle, index)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_rebuild failed");
+    goto table_insert_index_end;
+  }
   insert_ok = true;
 table_insert_index_end:
   if (ptr != NULL) {
     free(ptr);
   }
+  TRACE_END(__FUNCTION__, traced);
+  table_unlock(handle);
   return insert_ok;
 }
+
+/* Checks up to 'records' records starting at handle->scrub_cursor, reading them
+ * in a single block. Indexes whose CRC does not match are stored in 'corrupted'
+ * (up to corrupted_size of them); the cursor wraps around so that repeated calls
+ * from an idle loop cover the whole table. */
+bool table_scrub(table_handle_type *handle,
+                 uint16_t records,
+                 uint16_t *corrupted,
+                 uint16_t corrupted_size,
+                 uint16_t *corrupted_count) {
+
+  bool scrub_ok = false;
+  char *ptr = NULL;
+  uint32_t traced = 0;
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, (uint32_t)records*handle->record_size);
+  *corrupted_count=0;
+  if (handle->scrub_cursor>=handle->used_records) {
+    handle->scrub_cursor=0;
+  }
+  if (handle->record_size==handle->user_data_size || 0==handle->used_records) {
+    scrub_ok=true;
+    goto table_scrub_end;
+  }
+  if (records>handle->used_records-handle->scrub_cursor) {
+    records=handle->used_records-handle->scrub_cursor;
+  }
+
+  ptr=malloc((size_t)records*handle->record_size);
+  if (ptr == NULL) {
+    ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+    goto table_scrub_end;
+  }
+
+  if (!storage_read_block_from_file(handle->path,
+                                    (char*) ptr,
+                                    (size_t)records*handle->record_size,
+                                    table_record_offset(handle, handle->scrub_cursor))) {
+    ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+    goto table_scrub_end;
+  }
+
+  for (uint16_t i=0; i<records; i++) {
+    if (!table_record_verify(handle, (char*) ptr+(size_t)i*handle->record_size)) {
+      ESP_LOGW(__FUNCTION__, "%s: record %d corrupted", handle->path, handle->scrub_cursor+i);
+      if (*corrupted_count<corrupted_size) {
+        corrupted[*corrupted_count]=handle->scrub_cursor+i;
+        *corrupted_count=*corrupted_count+1;
+      }
+    }
+  }
+  handle->scrub_cursor=handle->scrub_cursor+records;
+  traced=(uint32_t)records*handle->record_size;
+  scrub_ok=true;
+table_scrub_end:
+  if (ptr != NULL) {
+    free(ptr);
+  }
+  TRACE_END(__FUNCTION__, traced);
+  table_unlock(handle);
+  return scrub_ok;
+}
+
+/* Reads records [from, to) in chunks of TABLE_SCAN_CHUNK_SIZE bytes and hands
+ * each one to callback, which returns false to stop the scan early. */
+bool table_scan(table_handle_type *handle,
+                uint16_t from,
+                uint16_t to,
+                table_scan_callback_type callback,
+                void *ctx) {
+
+  bool scan_ok = false;
+  char *ptr = NULL;
+  uint16_t chunk_records = TABLE_SCAN_CHUNK_SIZE/handle->record_size;
+
+  if (to>handle->used_records) {
+    to=handle->used_records;
+  }
+  if (from>=to) {
+    scan_ok=true;
+    goto table_scan_end;
+  }
+  if (0==chunk_records) {
+    chunk_records=1;
+  }
+  if (chunk_records>to-from) {
+    chunk_records=to-from;
+  }
+
+  ptr=malloc((size_t)chunk_records*handle->record_size);
+  if (ptr == NULL) {
+    ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+    goto table_scan_end;
+  }
+
+  for (uint16_t index=from; index<to; ) {
+    uint16_t records = (to-index>chunk_records) ? chunk_records : to-index;
+
+    if (!storage_read_block_from_file(handle->path,
+                                      ptr,
+                                      (size_t)records*handle->record_size,
+                                      table_record_offset(handle, index))) {
+      ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+      goto table_scan_end;
+    }
+    for (uint16_t i=0; i<records; i++, index++) {
+      char *record = ptr+(size_t)i*handle->record_size;
+
+      if (!table_record_verify(handle, record)) {
+        ESP_LOGE(__FUNCTION__, "record %d corrupted (CRC mismatch)", index);
+        goto table_scan_end;
+      }
+      if (!callback(record, index, ctx)) {
+        scan_ok=true;
+        goto table_scan_end;
+      }
+    }
+  }
+  scan_ok=true;
+table_scan_end:
+  if (ptr != NULL) {
+    free(ptr);
+  }
+  return scan_ok;
+}
+
+uint16_t table_field_size(const table_field_type *field) {
+  switch (field->kind) {
+    case TABLE_FIELD_UINT8:
+    case TABLE_FIELD_INT8:
+      return sizeof(uint8_t);
+    case TABLE_FIELD_UINT16:
+    case TABLE_FIELD_INT16:
+      return sizeof(uint16_t);
+    case TABLE_FIELD_UINT32:
+    case TABLE_FIELD_INT32:
+      return sizeof(uint32_t);
+  }
+  return 0;
+}
+
+int64_t table_field_value(const char *record, const table_field_type *field) {
+
+  const uint8_t *raw = (const uint8_t*) record+field->offset;
+  uint32_t value = 0;
+
+  for (uint16_t i=table_field_size(field); i>0; i--) {
+    value=(value<<8)|raw[i-1];
+  }
+  switch (field->kind) {
+    case TABLE_FIELD_INT8:
+      return (int8_t) value;
+    case TABLE_FIELD_INT16:
+      return (int16_t) value;
+    case TABLE_FIELD_INT32:
+      return (int32_t) value;
+    default:
+      return value;
+  }
+}
+
+typedef struct {
+  table_predicate_type predicate;
+  void *predicate_arg;
+  const table_projection_type *projection;
+  uint16_t user_data_size;
+  char *out;
+  uint16_t max;
+  uint16_t selected;
+} table_select_context_type;
+
+bool table_select_callback(const char *record, uint16_t index, void *ctx) {
+
+  table_select_context_type *select = ctx;
+
+  if (select->predicate != NULL && !select->predicate(record, select->predicate_arg)) {
+    return true;
+  }
+  if (select->projection != NULL) {
+    memcpy(select->out+(size_t)select->selected*select->projection->size,
+           record+select->projection->offset,
+           select->projection->size);
+  }
+  else {
+    memcpy(select->out+(size_t)select->selected*select->user_data_size,
+           record,
+           select->user_data_size);
+  }
+  select->selected++;
+  return select->selected<select->max;
+}
+
+/* Copies the projection of every record matching predicate (all records if
+ * NULL) into out, packed back to back, stopping after max matches. Without a
+ * projection the whole user data is copied. */
+bool table_select(table_handle_type *handle,
+                  table_predicate_type predicate,
+                  void *predicate_arg,
+                  const table_projection_type *projection,
+                  char *out,
+                  uint16_t max,
+                  uint16_t *selected) {
+
+  bool select_ok = false;
+  table_select_context_type select = {
+    .predicate = predicate,
+    .predicate_arg = predicate_arg,
+    .projection = projection,
+    .user_data_size = handle->user_data_size,
+    .out = out,
+    .max = max,
+    .selected = 0,
+  };
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, (uint32_t)handle->used_records*handle->record_size);
+  *selected=0;
+  if (projection != NULL &&
+      projection->offset+projection->size>handle->user_data_size) {
+    ESP_LOGE(__FUNCTION__, "projection out of record");
+    goto table_select_end;
+  }
+  if (0==max) {
+    select_ok=true;
+    goto table_select_end;
+  }
+  if (!table_scan(handle, 0, handle->used_records, table_select_callback, &select)) {
+    ESP_LOGE(__FUNCTION__, "table_scan failed");
+    goto table_select_end;
+  }
+  select_ok=true;
+table_select_end:
+  *selected=select.selected;
+  TRACE_END(__FUNCTION__, (uint32_t)handle->used_records*handle->record_size);
+  table_unlock(handle);
+  return select_ok;
+}
+
+typedef struct {
+  table_predicate_type predicate;
+  void *predicate_arg;
+  const table_field_type *field;
+  table_aggregate_type *result;
+} table_aggregate_context_type;
+
+bool table_aggregate_callback(const char *record, uint16_t index, void *ctx) {
+
+  table_aggregate_context_type *aggregate = ctx;
+  table_aggregate_type *result = aggregate->result;
+
+  if (aggregate->predicate != NULL && !aggregate->predicate(record, aggregate->predicate_arg)) {
+    return true;
+  }
+  if (aggregate->field != NULL) {
+    int64_t value = table_field_value(record, aggregate->field);
+
+    if (0==result->count || value<result->min) {
+      result->min=value;
+    }
+    if (0==result->count || value>result->max) {
+      result->max=value;
+    }
+    result->sum+=value;
+  }
+  result->count++;
+  return true;
+}
+
+/* Counts the records matching predicate (all records if NULL) and, if field is
+ * given, computes min, max and sum of that field over them. */
+bool table_aggregate(table_handle_type *handle,
+                     table_predicate_type predicate,
+                     void *predicate_arg,
+                     const table_field_type *field,
+                     table_aggregate_type *result) {
+
+  bool aggregate_ok = false;
+  table_aggregate_context_type aggregate = {
+    .predicate = predicate,
+    .predicate_arg = predicate_arg,
+    .field = field,
+    .result = result,
+  };
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, (uint32_t)handle->used_records*handle->record_size);
+  memset(result, 0, sizeof(table_aggregate_type));
+  if (field != NULL &&
+      field->offset+table_field_size(field)>handle->user_data_size) {
+    ESP_LOGE(__FUNCTION__, "field out of record");
+    goto table_aggregate_end;
+  }
+  if (NULL==predicate && NULL==field) {
+    result->count=handle->used_records;
+    aggregate_ok=true;
+    goto table_aggregate_end;
+  }
+  if (!table_scan(handle, 0, handle->used_records, table_aggregate_callback, &aggregate)) {
+    ESP_LOGE(__FUNCTION__, "table_scan failed");
+    goto table_aggregate_end;
+  }
+  aggregate_ok=true;
+table_aggregate_end:
+  TRACE_END(__FUNCTION__, (uint32_t)handle->used_records*handle->record_size);
+  table_unlock(handle);
+  return aggregate_ok;
+}
+
+bool table_zone_write_header(table_handle_type *handle, uint16_t used_records) {
+
+  table_zone_header_type zone_header = {
+    .used_records = used_records,
+    .zone_records = handle->zone_records,
+    .field_offset = handle->zone_field.offset,
+    .field_kind = handle->zone_field.kind,
+    .reserved = 0,
+  };
+
+  return storage_write_block_into_file(handle->zone_path,
+                                       (char*) &zone_header,
+                                       sizeof(table_zone_header_type),
+                                       TABLE_OFFSET_FILE_HEADER);
+}
+
+/* Folds the zone field value of a record about to be stored at index into its
+ * zone and persists the zone before the record is written, so that after a
+ * power loss the zone can only be wider than its records. */
+bool table_zone_update(table_handle_type *handle, uint16_t index, int64_t value, bool reset) {
+
+  uint16_t zone = index/handle->zone_records;
+  table_zone_type *entry = &handle->zones[zone];
+
+  if (reset) {
+    entry->min=value;
+    entry->max=value;
+  }
+  else if (value>=entry->min && value<=entry->max) {
+    return true;
+  }
+  else {
+    if (value<entry->min) {
+      entry->min=value;
+    }
+    if (value>entry->max) {
+      entry->max=value;
+    }
+  }
+  return storage_write_block_into_file(handle->zone_path,
+                                       (char*) entry,
+                                       sizeof(table_zone_type),
+                                       TABLE_OFFSET_ZONES+zone*sizeof(table_zone_type));
+}
+
+bool table_zone_rebuild_callback(const char *record, uint16_t index, void *ctx) {
+
+  table_handle_type *handle = ctx;
+  table_zone_type *entry = &handle->zones[index/handle->zone_records];
+  int64_t value = table_field_value(record, &handle->zone_field);
+
+  if (0==index%handle->zone_records) {
+    entry->min=value;
+    entry->max=value;
+  }
+  else {
+    if (value<entry->min) {
+      entry->min=value;
+    }
+    if (value>entry->max) {
+      entry->max=value;
+    }
+  }
+  return true;
+}
+
+/* Recomputes the zones holding records from index 'from' onwards (after records
+ * were shifted by an insert or delete) and persists them with the record count */
+bool table_zone_rebuild(table_handle_type *handle, uint16_t from) {
+
+  bool rebuild_ok = false;
+  uint16_t first_zone = from/handle->zone_records;
+  uint16_t used_zones = TABLE_ZONE_COUNT(handle->used_records, handle->zone_records);
+
+  if (!table_scan(handle,
+                  first_zone*handle->zone_records,
+                  handle->used_records,
+                  table_zone_rebuild_callback,
+                  handle)) {
+    ESP_LOGE(__FUNCTION__, "table_scan failed");
+    goto table_zone_rebuild_end;
+  }
+  if (first_zone<used_zones &&
+      !storage_write_block_into_file(handle->zone_path,
+                                     (char*) &handle->zones[first_zone],
+                                     (used_zones-first_zone)*sizeof(table_zone_type),
+                                     TABLE_OFFSET_ZONES+first_zone*sizeof(table_zone_type))) {
+    ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+    goto table_zone_rebuild_end;
+  }
+  if (!table_zone_write_header(handle, handle->used_records)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_write_header failed");
+    goto table_zone_rebuild_end;
+  }
+  rebuild_ok=true;
+table_zone_rebuild_end:
+  return rebuild_ok;
+}
+
+/* Keeps a min/max summary of 'field' for every block of zone_records records in
+ * zone_path, so that table_select_range can skip blocks that cannot match.
+ * Must be called after table_init. zones must hold
+ * TABLE_ZONE_COUNT(capacity, zone_records) entries. The zone map is rebuilt
+ * from the table when the file is missing, out of step with it, or was built
+ * with another zone_records or field. */
+bool table_zone_map_init(table_handle_type *handle,
+                         char *zone_path,
+                         const table_field_type *field,
+                         uint16_t zone_records,
+                         table_zone_type *zones,
+                         uint16_t zones_count) {
+
+  struct stat st;
+  bool init_ok = false;
+  table_zone_header_type zone_header;
+  size_t file_size = sizeof(table_zone_header_type)+zones_count*sizeof(table_zone_type);
+
+  if (0==zone_records ||
+      zones_count<TABLE_ZONE_COUNT(handle->capacity, zone_records)) {
+    ESP_LOGE(__FUNCTION__, "not enough zones");
+    goto table_zone_map_init_end;
+  }
+  if (field->offset+table_field_size(field)>handle->user_data_size) {
+    ESP_LOGE(__FUNCTION__, "field out of record");
+    goto table_zone_map_init_end;
+  }
+
+  handle->zone_field=*field;
+  handle->zone_records=zone_records;
+  handle->zones=zones;
+
+  if (0!=stat(zone_path, &st) || (size_t)st.st_size!=file_size) {
+    ESP_LOGI(__FUNCTION__, "%s not found or resized, will create...", zone_path);
+    storage_file_delete(zone_path);
+    if (!storage_create_file(zone_path, file_size)) {
+      ESP_LOGE(__FUNCTION__, "storage_create_file failed");
+      goto table_zone_map_init_end;
+    }
+    zone_header.used_records=UINT16_MAX;
+  }
+  else if (!storage_read_block_from_file(zone_path,
+                                         (char*) &zone_header,
+                                         sizeof(table_zone_header_type),
+                                         TABLE_OFFSET_FILE_HEADER)) {
+    ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+    goto table_zone_map_init_end;
+  }
+  handle->zone_path=zone_path;
+
+  // zones built for another block size or field do not bound this one
+  if (zone_header.used_records!=handle->used_records ||
+      zone_header.zone_records!=zone_records ||
+      zone_header.field_offset!=field->offset ||
+      zone_header.field_kind!=field->kind) {
+    ESP_LOGI(__FUNCTION__, "%s out of date, rebuilding", zone_path);
+    if (!table_zone_rebuild(handle, 0)) {
+      ESP_LOGE(__FUNCTION__, "table_zone_rebuild failed");
+      goto table_zone_map_init_end;
+    }
+  }
+  else if (handle->used_records>0 &&
+           !storage_read_block_from_file(zone_path,
+                                         (char*) zones,
+                                         TABLE_ZONE_COUNT(handle->used_records, zone_records)*
+                                         sizeof(table_zone_type),
+                                         TABLE_OFFSET_ZONES)) {
+    ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+    goto table_zone_map_init_end;
+  }
+  init_ok=true;
+table_zone_map_init_end:
+  if (!init_ok) {
+    handle->zone_path=NULL;
+  }
+  return init_ok;
+}
+
+typedef struct {
+  const table_field_type *field;
+  int64_t low;
+  int64_t high;
+} table_range_type;
+
+bool table_range_predicate(const char *record, void *arg) {
+
+  table_range_type *range = arg;
+  int64_t value = table_field_value(record, range->field);
+
+  return value>=range->low && value<=range->high;
+}
+
+/* Like table_select for the records whose zone field lies in [low, high], but
+ * only reads the blocks whose zone overlaps the range. */
+bool table_select_range(table_handle_type *handle,
+                        int64_t low,
+                        int64_t high,
+                        const table_projection_type *projection,
+                        char *out,
+                        uint16_t max,
+                        uint16_t *selected) {
+
+  bool select_ok = false;
+  table_range_type range = {
+    .field = &handle->zone_field,
+    .low = low,
+    .high = high,
+  };
+  table_select_context_type select = {
+    .predicate = table_range_predicate,
+    .predicate_arg = &range,
+    .projection = projection,
+    .user_data_size = handle->user_data_size,
+    .out = out,
+    .max = max,
+    .selected = 0,
+  };
+  uint16_t used_zones;
+  uint32_t traced = 0;      // bytes of the zones scanned
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, traced);
+  *selected=0;
+  if (handle->zone_path == NULL) {
+    ESP_LOGE(__FUNCTION__, "no zone map");
+    goto table_select_range_end;
+  }
+  if (projection != NULL &&
+      projection->offset+projection->size>handle->user_data_size) {
+    ESP_LOGE(__FUNCTION__, "projection out of record");
+    goto table_select_range_end;
+  }
+
+  used_zones=TABLE_ZONE_COUNT(handle->used_records, handle->zone_records);
+  for (uint16_t zone=0; zone<used_zones && select.selected<max; ) {
+    uint16_t last;
+    uint32_t end;
+
+    if (handle->zones[zone].max<low || handle->zones[zone].min>high) {
+      zone++;
+      continue;
+    }
+    // merge consecutive overlapping zones into a single sequential scan
+    for (last=zone+1; last<used_zones; last++) {
+      if (handle->zones[last].max<low || handle->zones[last].min>high) {
+        break;
+      }
+    }
+    end=(uint32_t)last*handle->zone_records;
+    if (end>handle->used_records) {
+      end=handle->used_records;
+    }
+    if (!table_scan(handle,
+                    zone*handle->zone_records,
+                    end,
+                    table_select_callback,
+                    &select)) {
+      ESP_LOGE(__FUNCTION__, "table_scan failed");
+      goto table_select_range_end;
+    }
+    traced+=(end-zone*handle->zone_records)*handle->record_size;
+    zone=last;
+  }
+  select_ok=true;
+table_select_range_end:
+  *selected=select.selected;
+  TRACE_END(__FUNCTION__, traced);
+  table_unlock(handle);
+  return select_ok;
+}
+
+void table_field_encode(char *raw, const table_field_type *field, int64_t value) {
+
+  uint32_t bits = (uint32_t) value;
+
+  for (uint16_t i=0; i<table_field_size(field); i++) {
+    raw[i]=(char) (bits&0xFF);
+    bits>>=8;
+  }
+}
+
+/* Overwrites len bytes at field_offset inside the record at index. Only those
+ * bytes (plus the record CRC, if enabled) are written, in a single file access;
+ * the rest of the record is only read when the CRC or the zone map needs it. */
+bool table_update_field(table_handle_type *handle,
+                        uint16_t index,
+                        uint16_t field_offset,
+                        uint16_t len,
+                        const char *data) {
+
+  bool update_ok = false;
+  char *record = NULL;
+  storage_segment_type segments[2];
+  size_t segments_count = 0;
+  long offset = table_record_offset(handle, index);
+  bool zone_overlap;
+  uint32_t traced = 0;      // bytes written
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, len);
+  if (index>=handle->used_records) {
+    ESP_LOGE(__FUNCTION__, "record not available");
+    goto table_update_field_end;
+  }
+  if (0==len || field_offset+len>handle->user_data_size) {
+    ESP_LOGE(__FUNCTION__, "field out of record");
+    goto table_update_field_end;
+  }
+  if (!table_snapshot_preserve(handle, index, index+1)) {
+    ESP_LOGE(__FUNCTION__, "table_snapshot_preserve failed");
+    goto table_update_field_end;
+  }
+  zone_overlap = handle->zone_path != NULL &&
+                 field_offset<handle->zone_field.offset+table_field_size(&handle->zone_field) &&
+                 handle->zone_field.offset<field_offset+len;
+
+  if (handle->record_size!=handle->user_data_size || zone_overlap) {
+    record=malloc(handle->record_size);
+    if (record == NULL) {
+      ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+      goto table_update_field_end;
+    }
+    if (!table_read_record(handle, index, record)) {
+      ESP_LOGE(__FUNCTION__, "table_read_record failed");
+      goto table_update_field_end;
+    }
+    memcpy(record+field_offset, data, len);
+    table_record_seal(handle, record);
+    if (zone_overlap &&
+        !table_zone_update(handle,
+                           index,
+                           table_field_value(record, &handle->zone_field),
+                           false)) {
+      ESP_LOGE(__FUNCTION__, "table_zone_update failed");
+      goto table_update_field_end;
+    }
+  }
+
+  segments[segments_count].block=(char*) data;
+  segments[segments_count].blocksize=len;
+  segments[segments_count].offset=offset+field_offset;
+  segments_count++;
+  if (handle->record_size!=handle->user_data_size) {
+    if (field_offset+len==handle->user_data_size) {
+      // field is adjacent to the CRC: write both in one segment
+      segments[0].block=record+field_offset;
+      segments[0].blocksize=len+TABLE_RECORD_CRC_SIZE;
+    }
+    else {
+      segments[segments_count].block=record+handle->user_data_size;
+      segments[segments_count].blocksize=TABLE_RECORD_CRC_SIZE;
+      segments[segments_count].offset=offset+handle->user_data_size;
+      segments_count++;
+    }
+  }
+
+  if (!storage_write_segments_into_file(handle->path, segments, segments_count)) {
+    ESP_LOGE(__FUNCTION__, "storage_write_segments_into_file failed");
+    goto table_update_field_end;
+  }
+  for (size_t i=0; i<segments_count; i++) {
+    traced+=segments[i].blocksize;
+  }
+  update_ok=true;
+table_update_field_end:
+  if (record != NULL) {
+    free(record);
+  }
+  TRACE_END(__FUNCTION__, traced);
+  table_unlock(handle);
+  return update_ok;
+}
+
+bool table_read_field(table_handle_type *handle,
+                      uint16_t index,
+                      const table_field_type *field,
+                      int64_t *value) {
+
+  bool read_ok = false;
+  char *record = NULL;
+  char raw[sizeof(uint32_t)];
+  table_field_type raw_field = { .offset = 0, .kind = field->kind };
+  // the whole record is read when its CRC must be checked
+  uint32_t traced = (handle->record_size!=handle->user_data_size) ?
+                    handle->record_size : table_field_size(field);
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, traced);
+  if (index>=handle->used_records) {
+    ESP_LOGE(__FUNCTION__, "record not available");
+    goto table_read_field_end;
+  }
+  if (field->offset+table_field_size(field)>handle->user_data_size) {
+    ESP_LOGE(__FUNCTION__, "field out of record");
+    goto table_read_field_end;
+  }
+
+  if (handle->record_size!=handle->user_data_size) {
+    // the whole record is needed to check its CRC
+    record=malloc(handle->record_size);
+    if (record == NULL) {
+      ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+      goto table_read_field_end;
+    }
+    if (!table_read_record(handle, index, record)) {
+      ESP_LOGE(__FUNCTION__, "table_read_record failed");
+      goto table_read_field_end;
+    }
+    *value=table_field_value(record, field);
+  }
+  else {
+    if (!storage_read_block_from_file(handle->path,
+                                      raw,
+                                      table_field_size(field),
+                                      table_record_offset(handle, index)+field->offset)) {
+      ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+      goto table_read_field_end;
+    }
+    *value=table_field_value(raw, &raw_field);
+  }
+  read_ok=true;
+table_read_field_end:
+  if (record != NULL) {
+    free(record);
+  }
+  TRACE_END(__FUNCTION__, traced);
+  table_unlock(handle);
+  return read_ok;
+}
+
+bool table_write_field(table_handle_type *handle,
+                       uint16_t index,
+                       const table_field_type *field,
+                       int64_t value) {
+
+  char raw[sizeof(uint32_t)];
+
+  table_field_encode(raw, field, value);
+  return table_update_field(handle, index, field->offset, table_field_size(field), raw);
+}
+
+/* Adds delta to a numeric field; the read and the write happen under the table
+ * lock, so concurrent increments from other tasks are not lost. */
+bool table_increment_field(table_handle_type *handle,
+                           uint16_t index,
+                           const table_field_type *field,
+                           int64_t delta,
+                           int64_t *result) {
+
+  bool increment_ok = false;
+  int64_t value;
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, table_field_size(field));
+  if (!table_read_field(handle, index, field, &value)) {
+    ESP_LOGE(__FUNCTION__, "table_read_field failed");
+    goto table_increment_field_end;
+  }
+  value=value+delta;
+  if (!table_write_field(handle, index, field, value)) {
+    ESP_LOGE(__FUNCTION__, "table_write_field failed");
+    goto table_increment_field_end;
+  }
+  if (result != NULL) {
+    *result=value;
+  }
+  increment_ok=true;
+table_increment_field_end:
+  TRACE_END(__FUNCTION__, table_field_size(field));
+  table_unlock(handle);
+  return increment_ok;
+}
+
+/* Opens the NVS namespace holding table metadata; the key is derived from the
+ * table path, which may be longer than an NVS key. */
+bool table_meta_open(table_handle_type *handle) {
+
+  bool open_ok = false;
+  esp_err_t ret;
+
+  snprintf(handle->meta_key, sizeof(handle->meta_key), "t%08lx",
+           (unsigned long) esp_rom_crc32_le(0, (uint8_t*) handle->path, strlen(handle->path)));
+  ret=nvs_open(TABLE_META_NAMESPACE, NVS_READWRITE, &handle->meta_nvs);
+  if (ret != ESP_OK) {
+    ESP_LOGE(__FUNCTION__, "nvs_open failed (%s)", esp_err_to_name(ret));
+    goto table_meta_open_end;
+  }
+  handle->sequence=0;
+  open_ok=true;
+table_meta_open_end:
+  return open_ok;
+}
+
+bool table_meta_write(table_handle_type *handle, uint16_t used_records) {
+
+  bool write_ok = false;
+  esp_err_t ret;
+  table_meta_type meta = {
+    .format_version = TABLE_FORMAT_VERSION,
+    .used_records = used_records,
+    .sequence = handle->sequence+1,
+  };
+
+  ret=nvs_set_blob(handle->meta_nvs, handle->meta_key, &meta, sizeof(table_meta_type));
+  if (ret == ESP_OK) {
+    ret=nvs_commit(handle->meta_nvs);
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(__FUNCTION__, "%s: nvs write failed (%s)", handle->meta_key, esp_err_to_name(ret));
+    goto table_meta_write_end;
+  }
+  handle->sequence=meta.sequence;
+  write_ok=true;
+table_meta_write_end:
+  return write_ok;
+}
+
+/* Reads the stamp left by table_meta_refresh_file; false if the file has none
+ * (created before the stamp existed, or by another build) or it is corrupted. */
+bool table_meta_stamp_read(table_handle_type *handle, table_stamp_type *stamp) {
+
+  struct stat st;
+
+  if (0!=stat(handle->path, &st) ||
+      (size_t)st.st_size<TABLE_OFFSET_STAMP(handle)+sizeof(table_stamp_type)) {
+    return false;
+  }
+  if (!storage_read_block_from_file(handle->path,
+                                    (char*) stamp,
+                                    sizeof(table_stamp_type),
+                                    TABLE_OFFSET_STAMP(handle))) {
+    ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+    return false;
+  }
+  return stamp->crc==esp_rom_crc32_le(0, (uint8_t*) stamp, offsetof(table_stamp_type, crc));
+}
+
+/* Writes the stamp of path, a table file laid out as handle's */
+bool table_meta_stamp_write(table_handle_type *handle, char *path, uint32_t sequence, uint16_t used_records) {
+
+  table_stamp_type stamp = {
+    .sequence = sequence,
+    .used_records = used_records,
+    .reserved = 0,
+  };
+
+  stamp.crc=esp_rom_crc32_le(0, (uint8_t*) &stamp, offsetof(table_stamp_type, crc));
+  return storage_write_block_into_file(path,
+                                       (char*) &stamp,
+                                       sizeof(table_stamp_type),
+                                       TABLE_OFFSET_STAMP(handle));
+}
+
+/* Copies the NVS record count and sequence to the file header and stamp */
+bool table_meta_refresh_file(table_handle_type *handle) {
+
+  bool refresh_ok = false;
+  table_header_type file_header = {
+    .used_records = handle->used_records,
+  };
+
+  if (!storage_write_block_into_file(handle->path,
+                                     (char*) &file_header,
+                                     sizeof(table_header_type),
+                                     TABLE_OFFSET_FILE_HEADER)) {
+    ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+    goto table_meta_refresh_file_end;
+  }
+  if (!table_meta_stamp_write(handle, handle->path, handle->sequence, handle->used_records)) {
+    ESP_LOGE(__FUNCTION__, "table_meta_stamp_write failed");
+    goto table_meta_refresh_file_end;
+  }
+  refresh_ok=true;
+table_meta_refresh_file_end:
+  return refresh_ok;
+}
+
+/* Loads the metadata of an existing table from NVS and cross-checks it with
+ * the file. The file header and stamp hold the count and sequence of the last
+ * refresh, and NVS normally has moved on from there. NVS wins unless its
+ * sequence is older than the stamp (NVS restored or reflashed behind the
+ * file) or it has no valid entry (first boot with this option, erased NVS,
+ * format change); the file header is used then. The file is refreshed here so
+ * that it stays a reasonable fallback. table_sort stamps the file it swaps in
+ * one sequence ahead of NVS, so its count wins if power was lost before NVS
+ * was updated. */
+bool table_meta_init(table_handle_type *handle) {
+
+  bool init_ok = false;
+  esp_err_t ret;
+  table_meta_type meta;
+  table_header_type file_header;
+  table_stamp_type stamp;
+  bool stamped;
+  size_t meta_size = sizeof(table_meta_type);
+
+  if (!storage_read_block_from_file(handle->path,
+                                    (char*) &file_header,
+                                    sizeof(table_header_type),
+                                    TABLE_OFFSET_FILE_HEADER)) {
+    ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+    goto table_meta_init_end;
+  }
+  stamped=table_meta_stamp_read(handle, &stamp);
+
+  ret=nvs_get_blob(handle->meta_nvs, handle->meta_key, &meta, &meta_size);
+  if (ret != ESP_OK || meta_size != sizeof(table_meta_type) ||
+      meta.format_version != TABLE_FORMAT_VERSION ||
+      meta.used_records > handle->capacity) {
+    ESP_LOGW(__FUNCTION__, "%s: no valid metadata in NVS, using file header (%d records)",
+             handle->path, file_header.used_records);
+  }
+  else if (stamped && stamp.sequence > meta.sequence) {
+    ESP_LOGW(__FUNCTION__, "%s: NVS sequence %lu older than file sequence %lu, using file header (%d records)",
+             handle->path, (unsigned long) meta.sequence, (unsigned long) stamp.sequence,
+             file_header.used_records);
+  }
+  else {
+    handle->sequence=meta.sequence;
+    handle->used_records=meta.used_records;
+    if (file_header.used_records != meta.used_records) {
+      ESP_LOGI(__FUNCTION__, "%s: file header %d records, NVS %d records (sequence %lu)",
+               handle->path, file_header.used_records, meta.used_records,
+               (unsigned long) meta.sequence);
+    }
+    goto table_meta_init_refresh;
+  }
+
+  if (file_header.used_records > handle->capacity) {
+    ESP_LOGE(__FUNCTION__, "%s: file header corrupted", handle->path);
+    goto table_meta_init_end;
+  }
+  // keep sequences increasing across NVS erases
+  handle->sequence=stamped ? stamp.sequence : 0;
+  if (!table_meta_write(handle, file_header.used_records)) {
+    ESP_LOGE(__FUNCTION__, "table_meta_write failed");
+    goto table_meta_init_end;
+  }
+  handle->used_records=file_header.used_records;
+table_meta_init_refresh:
+  if (!stamped ||
+      stamp.sequence != handle->sequence ||
+      file_header.used_records != handle->used_records) {
+    if (!table_meta_refresh_file(handle)) {
+      ESP_LOGE(__FUNCTION__, "table_meta_refresh_file failed");
+      goto table_meta_init_end;
+    }
+  }
+  init_ok=true;
+table_meta_init_end:
+  return init_ok;
+}
+
+typedef struct {
+  char *path;
+  bool append;              // runs are appended, the sorted table is written in place
+  long offset;
+  char *buffer;
+  uint16_t size;            // records the buffer can hold
+  uint16_t count;           // records waiting in the buffer
+  uint16_t emitted;
+  uint16_t record_size;
+  bool dedup;
+  char *last;               // last emitted record, compared against when dedup
+  table_comparator_type comparator;
+} table_sort_output_type;
+
+typedef struct {
+  char *buffer;
+  uint16_t size;
+  uint16_t count;
+  uint16_t position;
+  uint32_t next;            // next record of the run to load
+  uint32_t end;
+} table_sort_input_type;
+
+bool table_sort_flush(table_sort_output_type *output) {
+
+  size_t size = (size_t)output->count*output->record_size;
+
+  if (0==output->count) {
+    return true;
+  }
+  if (output->append) {
+    if (!storage_append_block_to_file(output->path, output->buffer, size)) {
+      return false;
+    }
+  }
+  else {
+    if (!storage_write_block_into_file(output->path, output->buffer, size, output->offset)) {
+      return false;
+    }
+    output->offset+=size;
+  }
+  output->count=0;
+  return true;
+}
+
+bool table_sort_emit(table_sort_output_type *output, const char *record) {
+
+  if (output->dedup) {
+    if (output->emitted>0 && 0==output->comparator(output->last, record)) {
+      return true;
+    }
+    memcpy(output->last, record, output->record_size);
+  }
+  memcpy(output->buffer+(size_t)output->count*output->record_size, record, output->record_size);
+  output->count++;
+  output->emitted++;
+  if (output->count==output->size) {
+    return table_sort_flush(output);
+  }
+  return true;
+}
+
+bool table_sort_refill(table_sort_input_type *input, char *path, uint16_t record_size) {
+
+  uint16_t records = (input->end-input->next>input->size) ? input->size : input->end-input->next;
+
+  if (!storage_read_block_from_file(path,
+                                    input->buffer,
+                                    (size_t)records*record_size,
+                                    (long)input->next*record_size)) {
+    return false;
+  }
+  input->count=records;
+  input->position=0;
+  input->next+=records;
+  return true;
+}
+
+/* External merge sort: runs of scratch_size bytes are sorted in RAM and
+ * appended to a run file, then merged TABLE_SORT_MAX_FANIN at a time (at most)
+ * until one run is left. The last merge writes a complete new table file,
+ * which replaces the table. scratch bounds the RAM used, whatever the table
+ * size. With dedup, records comparing equal to the previous one are dropped. */
+bool table_sort_records(table_handle_type *handle,
+                        table_comparator_type comparator,
+                        char *scratch,
+                        size_t scratch_size,
+                        bool dedup) {
+
+  bool sort_ok = false;
+  bool swapping = false;    // the table file is gone, new_path must be kept
+  char run_path[2][TABLE_PATH_MAX];
+  char new_path[TABLE_PATH_MAX];
+  uint16_t rs = handle->record_size;
+  uint32_t slots = scratch_size/rs;
+  uint32_t used = handle->used_records;
+  table_header_type table_header;
+  table_sort_input_type inputs[TABLE_SORT_MAX_FANIN];
+  table_sort_output_type output = {
+    .record_size = rs,
+    .comparator = comparator,
+    .last = NULL,
+  };
+
+  snprintf(run_path[0], TABLE_PATH_MAX, "%s.r0", handle->path);
+  snprintf(run_path[1], TABLE_PATH_MAX, "%s.r1", handle->path);
+  snprintf(new_path, TABLE_PATH_MAX, "%s.new", handle->path);
+  if (slots<3) {
+    ESP_LOGE(__FUNCTION__, "scratch must hold at least 3 records");
+    goto table_sort_records_end;
+  }
+  if (slots>UINT16_MAX) {
+    slots=UINT16_MAX;
+  }
+  if (dedup) {
+    output.last=malloc(rs);
+    if (output.last == NULL) {
+      ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+      goto table_sort_records_end;
+    }
+  }
+
+  storage_file_delete(run_path[0]);
+  storage_file_delete(run_path[1]);
+  storage_file_delete(new_path);
+  if (!storage_create_file(new_path, sizeof(table_header_type)+(size_t)handle->capacity*rs)) {
+    ESP_LOGE(__FUNCTION__, "storage_create_file failed");
+    goto table_sort_records_end;
+  }
+
+  if (used<=slots) {
+    // fits in scratch: sort, compact duplicates in place and write once
+    uint32_t kept = 0;
+
+    if (used>0 &&
+        !storage_read_block_from_file(handle->path, scratch, used*rs, table_record_offset(handle, 0))) {
+      ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+      goto table_sort_records_end;
+    }
+    for (uint32_t i=0; i<used; i++) {
+      if (!table_record_verify(handle, scratch+i*rs)) {
+        ESP_LOGE(__FUNCTION__, "record %lu corrupted (CRC mismatch)", (unsigned long) i);
+        goto table_sort_records_end;
+      }
+    }
+    qsort(scratch, used, rs, comparator);
+    for (uint32_t i=0; i<used; i++) {
+      if (dedup && kept>0 && 0==comparator(scratch+(kept-1)*rs, scratch+i*rs)) {
+        continue;
+      }
+      if (kept!=i) {
+        memmove(scratch+kept*rs, scratch+i*rs, rs);
+      }
+      kept++;
+    }
+    if (kept>0 &&
+        !storage_write_block_into_file(new_path, scratch, kept*rs, table_record_offset(handle, 0))) {
+      ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+      goto table_sort_records_end;
+    }
+    output.emitted=kept;
+  }
+  else {
+    uint32_t runs = 0;
+    uint32_t run_len = slots;
+    uint16_t fanin = (slots-1<TABLE_SORT_MAX_FANIN) ? slots-1 : TABLE_SORT_MAX_FANIN;
+    uint16_t buffer_records = slots/(fanin+1);
+    int src = 0;
+
+    // pass 0: sorted runs of 'slots' records
+    for (uint32_t index=0; index<used; index+=slots, runs++) {
+      uint32_t records = (used-index>slots) ? slots : used-index;
+
+      if (!storage_read_block_from_file(handle->path, scratch, records*rs,
+                                        table_record_offset(handle, index))) {
+        ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+        goto table_sort_records_end;
+      }
+      for (uint32_t i=0; i<records; i++) {
+        if (!table_record_verify(handle, scratch+i*rs)) {
+          ESP_LOGE(__FUNCTION__, "record %lu corrupted (CRC mismatch)", (unsigned long) (index+i));
+          goto table_sort_records_end;
+        }
+      }
+      qsort(scratch, records, rs, comparator);
+      if (!storage_append_block_to_file(run_path[0], scratch, records*rs)) {
+        ESP_LOGE(__FUNCTION__, "storage_append_block_to_file failed");
+        goto table_sort_records_end;
+      }
+    }
+
+    // merge passes; the one left with at most 'fanin' runs writes the new table
+    for (;;) {
+      bool final = runs<=fanin;
+
+      output.buffer=scratch+(size_t)fanin*buffer_records*rs;
+      output.size=buffer_records;
+      output.count=0;
+      output.emitted=0;
+      output.dedup=final && dedup;
+      if (final) {
+        output.path=new_path;
+        output.append=false;
+        output.offset=table_record_offset(handle, 0);
+      }
+      else {
+        output.path=run_path[1-src];
+        output.append=true;
+        storage_file_delete(output.path);
+      }
+
+      for (uint32_t group=0; group<runs; group+=fanin) {
+        uint16_t active = (runs-group>fanin) ? fanin : runs-group;
+
+        for (uint16_t i=0; i<active; i++) {
+          inputs[i].buffer=scratch+(size_t)i*buffer_records*rs;
+          inputs[i].size=buffer_records;
+          inputs[i].next=(group+i)*run_len;
+          inputs[i].end=(group+i+1)*run_len;
+          if (inputs[i].end>used) {
+            inputs[i].end=used;
+          }
+          if (!table_sort_refill(&inputs[i], run_path[src], rs)) {
+            ESP_LOGE(__FUNCTION__, "table_sort_refill failed");
+            goto table_sort_records_end;
+          }
+        }
+        for (;;) {
+          int smallest = -1;
+
+          for (uint16_t i=0; i<active; i++) {
+            if (inputs[i].position<inputs[i].count &&
+                (smallest<0 ||
+                 comparator(inputs[i].buffer+(size_t)inputs[i].position*rs,
+                            inputs[smallest].buffer+(size_t)inputs[smallest].position*rs)<0)) {
+              smallest=i;
+            }
+          }
+          if (smallest<0) {
+            break;
+          }
+          if (!table_sort_emit(&output, inputs[smallest].buffer+(size_t)inputs[smallest].position*rs)) {
+            ESP_LOGE(__FUNCTION__, "table_sort_emit failed");
+            goto table_sort_records_end;
+          }
+          inputs[smallest].position++;
+          if (inputs[smallest].position==inputs[smallest].count &&
+              inputs[smallest].next<inputs[smallest].end &&
+              !table_sort_refill(&inputs[smallest], run_path[src], rs)) {
+            ESP_LOGE(__FUNCTION__, "table_sort_refill failed");
+            goto table_sort_records_end;
+          }
+        }
+      }
+      if (!table_sort_flush(&output)) {
+        ESP_LOGE(__FUNCTION__, "table_sort_flush failed");
+        goto table_sort_records_end;
+      }
+      if (final) {
+        break;
+      }
+      runs=(runs+fanin-1)/fanin;
+      run_len=run_len*fanin;
+      storage_file_delete(run_path[src]);
+      src=1-src;
+    }
+  }
+
+  table_header.used_records=output.emitted;
+  if (!storage_write_block_into_file(new_path,
+                                     (char*) &table_header,
+                                     sizeof(table_header_type),
+                                     TABLE_OFFSET_FILE_HEADER)) {
+    ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+    goto table_sort_records_end;
+  }
+#ifdef CONFIG_TABLE_META_IN_NVS
+  // one ahead of NVS: table_meta_init prefers this count until NVS has it
+  if (!table_meta_stamp_write(handle, new_path, handle->sequence+1, output.emitted)) {
+    ESP_LOGE(__FUNCTION__, "table_meta_stamp_write failed");
+    goto table_sort_records_end;
+  }
+#endif
+
+  if (!table_snapshot_preserve(handle, 0, used)) {
+    ESP_LOGE(__FUNCTION__, "table_snapshot_preserve failed");
+    goto table_sort_records_end;
+  }
+  // the zone map no longer matches: rebuilt by table_zone_map_init if power
+  // is lost before table_zone_rebuild below
+  if (handle->zone_path != NULL && !table_zone_write_header(handle, UINT16_MAX)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_write_header failed");
+    goto table_sort_records_end;
+  }
+  // swap in: SPIFFS cannot rename over a file; table_init finishes an
+  // interrupted swap by renaming the .new file
+  swapping=true;
+  storage_file_delete(handle->path);
+  if (!storage_rename_file(new_path, handle->path)) {
+    ESP_LOGE(__FUNCTION__, "storage_rename_file failed");
+    goto table_sort_records_end;
+  }
+#ifdef CONFIG_TABLE_META_IN_NVS
+  if (!table_meta_write(handle, output.emitted)) {
+    ESP_LOGE(__FUNCTION__, "table_meta_write failed");
+    goto table_sort_records_end;
+  }
+#endif
+  handle->used_records=output.emitted;
+  if (handle->zone_path != NULL && !table_zone_rebuild(handle, 0)) {
+    ESP_LOGE(__FUNCTION__, "table_zone_rebuild failed");
+    goto table_sort_records_end;
+  }
+  sort_ok=true;
+table_sort_records_end:
+  storage_file_delete(run_path[0]);
+  storage_file_delete(run_path[1]);
+  if (!swapping) {
+    storage_file_delete(new_path);
+  }
+  if (output.last != NULL) {
+    free(output.last);
+  }
+  return sort_ok;
+}
+
+bool table_sort(table_handle_type *handle,
+                table_comparator_type comparator,
+                char *scratch,
+                size_t scratch_size) {
+
+  bool sort_ok;
+  uint32_t traced;
+
+  table_lock(handle);
+  traced=(uint32_t)handle->used_records*handle->record_size;
+  TRACE_BEGIN(__FUNCTION__, traced);
+  sort_ok=table_sort_records(handle, comparator, scratch, scratch_size, false);
+  TRACE_END(__FUNCTION__, traced);
+  table_unlock(handle);
+  return sort_ok;
+}
+
+/* Sorts the table and keeps one record of every group comparing equal */
+bool table_dedup(table_handle_type *handle,
+                 table_comparator_type comparator,
+                 char *scratch,
+                 size_t scratch_size) {
+
+  bool dedup_ok;
+  uint32_t traced;
+
+  table_lock(handle);
+  traced=(uint32_t)handle->used_records*handle->record_size;
+  TRACE_BEGIN(__FUNCTION__, traced);
+  dedup_ok=table_sort_records(handle, comparator, scratch, scratch_size, true);
+  TRACE_END(__FUNCTION__, traced);
+  table_unlock(handle);
+  return dedup_ok;
+}
+
+bool table_snapshot_dirty(table_handle_type *handle, uint16_t index) {
+  return 0!=(handle->dirty[index/8]&(1<<(index%8)));
+}
+
+void table_snapshot_mark(table_handle_type *handle, uint16_t index) {
+  handle->dirty[index/8]|=1<<(index%8);
+}
+
+/* Called before records [from, to) are overwritten. The ones still shared with
+ * the snapshot are copied to the snapshot file, once, and all of them are
+ * marked dirty. */
+bool table_snapshot_preserve(table_handle_type *handle, uint16_t from, uint16_t to) {
+
+  bool preserve_ok = false;
+  char *ptr = NULL;
+  uint16_t chunk_records = TABLE_SCAN_CHUNK_SIZE/handle->record_size;
+  uint16_t index = from;
+
+  if (handle->snapshot_path == NULL || 0==handle->snapshot_id) {
+    preserve_ok=true;
+    goto table_snapshot_preserve_end;
+  }
+  if (0==chunk_records) {
+    chunk_records=1;
+  }
+
+  while (index<to) {
+    uint16_t records = 0;
+
+    while (index+records<to &&
+           index+records<handle->snapshot_used_records &&
+           records<chunk_records &&
+           !table_snapshot_dirty(handle, index+records)) {
+      records++;
+    }
+    if (0==records) {
+      // already preserved, or not part of the snapshot
+      table_snapshot_mark(handle, index);
+      index++;
+      continue;
+    }
+    if (ptr == NULL) {
+      ptr=malloc((size_t)chunk_records*handle->record_size);
+      if (ptr == NULL) {
+        ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+        goto table_snapshot_preserve_end;
+      }
+    }
+    if (!storage_read_block_from_file(handle->path,
+                                      ptr,
+                                      (size_t)records*handle->record_size,
+                                      table_record_offset(handle, index))) {
+      ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+      goto table_snapshot_preserve_end;
+    }
+    if (!storage_write_block_into_file(handle->snapshot_path,
+                                       ptr,
+                                       (size_t)records*handle->record_size,
+                                       (long)index*handle->record_size)) {
+      ESP_LOGE(__FUNCTION__, "storage_write_block_into_file failed");
+      goto table_snapshot_preserve_end;
+    }
+    for (uint16_t i=0; i<records; i++, index++) {
+      table_snapshot_mark(handle, index);
+    }
+  }
+  preserve_ok=true;
+table_snapshot_preserve_end:
+  if (ptr != NULL) {
+    free(ptr);
+  }
+  return preserve_ok;
+}
+
+void table_snapshot_take(table_handle_type *handle) {
+
+  uint32_t previous = handle->snapshot_id;
+
+  memset(handle->dirty, 0, TABLE_SNAPSHOT_BITMAP_SIZE(handle->capacity));
+  handle->snapshot_used_records=handle->used_records;
+  // random, so that an id handed out before a reboot does not match
+  do {
+    handle->snapshot_id=esp_random();
+  } while (0==handle->snapshot_id || previous==handle->snapshot_id);
+}
+
+/* Enables snapshots. Once one is taken, the old image of every record it holds
+ * is copied to snapshot_path (one slot per record) the first time the record
+ * changes, and bitmap, of TABLE_SNAPSHOT_BITMAP_SIZE(capacity) bytes, tracks
+ * the records changed since. Must be called after table_init. The bitmap is
+ * kept in RAM only: after a reboot table_export_delta exports everything. */
+bool table_snapshot_init(table_handle_type *handle,
+                         char *snapshot_path,
+                         uint8_t *bitmap,
+                         size_t bitmap_size) {
+
+  struct stat st;
+  bool init_ok = false;
+  size_t file_size = (size_t)handle->capacity*handle->record_size;
+
+  if (bitmap_size<(size_t)TABLE_SNAPSHOT_BITMAP_SIZE(handle->capacity)) {
+    ESP_LOGE(__FUNCTION__, "bitmap too small");
+    goto table_snapshot_init_end;
+  }
+  if (0!=stat(snapshot_path, &st) || (size_t)st.st_size!=file_size) {
+    ESP_LOGI(__FUNCTION__, "%s not found, will create...", snapshot_path);
+    if (!storage_create_file(snapshot_path, file_size)) {
+      ESP_LOGE(__FUNCTION__, "storage_create_file failed");
+      goto table_snapshot_init_end;
+    }
+  }
+  handle->dirty=bitmap;
+  handle->snapshot_id=0;
+  handle->snapshot_used_records=0;
+  handle->snapshot_path=snapshot_path;
+  init_ok=true;
+table_snapshot_init_end:
+  return init_ok;
+}
+
+/* Freezes the current content of the table. Nothing is copied now: records are
+ * preserved as they are changed afterwards. Only the latest snapshot is kept. */
+bool table_snapshot(table_handle_type *handle, uint32_t *snapshot_id) {
+
+  bool snapshot_ok = false;
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, 0);
+  if (handle->snapshot_path == NULL) {
+    ESP_LOGE(__FUNCTION__, "snapshots not enabled");
+    goto table_snapshot_end;
+  }
+  table_snapshot_take(handle);
+  *snapshot_id=handle->snapshot_id;
+  snapshot_ok=true;
+table_snapshot_end:
+  TRACE_END(__FUNCTION__, 0);
+  table_unlock(handle);
+  return snapshot_ok;
+}
+
+/* Reads records [from, from+count) as they were when the snapshot was taken,
+ * whole and checked, into records. The caller holds the lock. */
+bool table_snapshot_read_records(table_handle_type *handle, uint16_t from, uint16_t count, char *records) {
+
+  uint16_t index = from;
+
+  while (index<from+count) {
+    bool dirty = table_snapshot_dirty(handle, index);
+    uint16_t run = 1;
+
+    // consecutive records living in the same file are read at once
+    while (index+run<from+count && dirty==table_snapshot_dirty(handle, index+run)) {
+      run++;
+    }
+    if (!storage_read_block_from_file(dirty ? handle->snapshot_path : handle->path,
+                                      records+(size_t)(index-from)*handle->record_size,
+                                      (size_t)run*handle->record_size,
+                                      dirty ? (long)index*handle->record_size :
+                                              table_record_offset(handle, index))) {
+      ESP_LOGE(__FUNCTION__, "storage_read_block_from_file failed");
+      return false;
+    }
+    for (uint16_t i=0; i<run; i++, index++) {
+      if (!table_record_verify(handle, records+(size_t)(index-from)*handle->record_size)) {
+        ESP_LOGE(__FUNCTION__, "record %d corrupted (CRC mismatch)", index);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/* Copies the user data of records [from, from+count) as they were when the
+ * snapshot was taken into out, packed. Writers are not blocked between calls,
+ * and readers never see a record half way through a shift. */
+bool table_snapshot_read_range(table_handle_type *handle,
+                               uint16_t from,
+                               uint16_t count,
+                               char *out) {
+
+  bool read_ok = false;
+  char *ptr = NULL;
+  uint16_t chunk_records = TABLE_SCAN_CHUNK_SIZE/handle->record_size;
+  uint16_t index = from;
+
+  table_lock(handle);
+  TRACE_BEGIN(__FUNCTION__, (uint32_t)count*handle->record_size);
+  if (handle->snapshot_path == NULL || 0==handle->snapshot_id) {
+    ESP_LOGE(__FUNCTION__, "no snapshot");
+    goto table_snapshot_read_range_end;
+  }
+  if (from>handle->snapshot_used_records || count>handle->snapshot_used_records-from) {
+    ESP_LOGE(__FUNCTION__, "records not available");
+    goto table_snapshot_read_range_end;
+  }
+  if (0==chunk_records) {
+    chunk_records=1;
+  }
+  if (chunk_records>count) {
+    chunk_records=count;
+  }
+  if (count>0) {
+    ptr=malloc((size_t)chunk_records*handle->record_size);
+    if (ptr == NULL) {
+      ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+      goto table_snapshot_read_range_end;
+    }
+  }
+
+  while (index<from+count) {
+    uint16_t records = (from+count-index>chunk_records) ? chunk_records : from+count-index;
+
+    if (!table_snapshot_read_records(handle, index, records, ptr)) {
+      ESP_LOGE(__FUNCTION__, "table_snapshot_read_records failed");
+      goto table_snapshot_read_range_end;
+    }
+    for (uint16_t i=0; i<records; i++, index++) {
+      memcpy(out+(size_t)(index-from)*handle->user_data_size,
+             ptr+(size_t)i*handle->record_size,
+             handle->user_data_size);
+    }
+  }
+  read_ok=true;
+table_snapshot_read_range_end:
+  if (ptr != NULL) {
+    free(ptr);
+  }
+  TRACE_END(__FUNCTION__, (uint32_t)count*handle->record_size);
+  table_unlock(handle);
+  return read_ok;
+}
+
+/* Takes the snapshot an export streams from, and copies to changed the records
+ * to export: the ones changed since since_snapshot, or all of them when that
+ * is not the current snapshot. */
+bool table_export_delta_freeze(table_handle_type *handle,
+                               uint32_t since_snapshot,
+                               uint8_t *changed,
+                               uint32_t *snapshot_id,
+                               uint16_t *used_records,
+                               bool *full) {
+
+  bool freeze_ok = false;
+
+  table_lock(handle);
+  if (handle->snapshot_path == NULL) {
+    ESP_LOGE(__FUNCTION__, "snapshots not enabled");
+    goto table_export_delta_freeze_end;
+  }
+  *full = 0==since_snapshot || since_snapshot!=handle->snapshot_id;
+  if (*full) {
+    memset(changed, 0xff, TABLE_SNAPSHOT_BITMAP_SIZE(handle->capacity));
+  }
+  else {
+    memcpy(changed, handle->dirty, TABLE_SNAPSHOT_BITMAP_SIZE(handle->capacity));
+  }
+  table_snapshot_take(handle);
+  *snapshot_id=handle->snapshot_id;
+  *used_records=handle->snapshot_used_records;
+  freeze_ok=true;
+table_export_delta_freeze_end:
+  table_unlock(handle);
+  return freeze_ok;
+}
+
+/* Hands to callback every record changed since snapshot since_snapshot, or all
+ * of them when that is not the current snapshot (0, or taken before a reboot);
+ * *full tells which. The new snapshot, returned as *snapshot_id, is taken
+ * first and the records are read from it, so the export is consistent while
+ * the table is only locked for each chunk read: callback may block (on a
+ * transport, say) without holding up writers. The table held *used_records
+ * records at that point, the ones beyond were deleted. A new snapshot taken
+ * meanwhile fails the export. After a failed or stopped export the previous
+ * snapshot is gone, so the next one is a full export. */
+bool table_export_delta(table_handle_type *handle,
+                        uint32_t since_snapshot,
+                        table_scan_callback_type callback,
+                        void *ctx,
+                        uint32_t *snapshot_id,
+                        uint16_t *used_records,
+                        bool *full) {
+
+  bool export_ok = false;
+  uint8_t *changed = NULL;
+  char *ptr = NULL;
+  uint16_t chunk_records = TABLE_SCAN_CHUNK_SIZE/handle->record_size;
+  uint32_t taken;
+  uint16_t used;
+  uint16_t index = 0;
+  uint32_t traced = 0;      // bytes handed to callback
+
+  TRACE_BEGIN(__FUNCTION__, traced);
+  if (0==chunk_records) {
+    chunk_records=1;
+  }
+  changed=malloc(TABLE_SNAPSHOT_BITMAP_SIZE(handle->capacity));
+  ptr=malloc((size_t)chunk_records*handle->record_size);
+  if (changed == NULL || ptr == NULL) {
+    ESP_LOGE(__FUNCTION__, "Could not allocate heap memory");
+    goto table_export_delta_end;
+  }
+  if (!table_export_delta_freeze(handle, since_snapshot, changed, &taken, &used, full)) {
+    ESP_LOGE(__FUNCTION__, "table_export_delta_freeze failed");
+    goto table_export_delta_end;
+  }
+
+  while (index<used) {
+    uint16_t records = 1;
+    bool read_ok;
+
+    if (0==(changed[index/8]&(1<<(index%8)))) {
+      index++;
+      continue;
+    }
+    while (index+records<used &&
+           records<chunk_records &&
+           0!=(changed[(index+records)/8]&(1<<((index+records)%8)))) {
+      records++;
+    }
+    table_lock(handle);
+    read_ok = handle->snapshot_id==taken &&
+              table_snapshot_read_records(handle, index, records, ptr);
+    table_unlock(handle);
+    if (!read_ok) {
+      ESP_LOGE(__FUNCTION__, "snapshot replaced or read failed");
+      goto table_export_delta_end;
+    }
+    for (uint16_t i=0; i<records; i++, index++) {
+      if (!callback(ptr+(size_t)i*handle->record_size, index, ctx)) {
+        ESP_LOGW(__FUNCTION__, "export stopped");
+        goto table_export_delta_end;
+      }
+      traced+=handle->record_size;
+    }
+  }
+  *snapshot_id=taken;
+  *used_records=used;
+  export_ok=true;
+table_export_delta_end:
+  if (ptr != NULL) {
+    free(ptr);
+  }
+  if (changed != NULL) {
+    free(changed);
+  }
+  TRACE_END(__FUNCTION__, traced);
+  return export_ok;
+}
@@ -1,21 +1,122 @@
 #ifndef TABLES_H
 #define TABLES_H
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+
+#define TABLE_FORMAT_VERSION 1
+#define TABLE_META_NAMESPACE "tables"
 
 typedef struct { 
   uint16_t used_records;
 } table_header_type;
 
+// per-table metadata kept in NVS when CONFIG_TABLE_META_IN_NVS is set
+typedef struct {
+  uint16_t format_version;
+  uint16_t used_records;
+  uint32_t sequence;        // incremented on every change of used_records
+} table_meta_type;
+
+// written after the last record slot when table_init refreshes the file header
+// from NVS, so that an NVS older than the file can be told apart
+typedef struct {
+  uint32_t sequence;        // NVS sequence the header was refreshed with
+  uint16_t used_records;
+  uint16_t reserved;
+  uint32_t crc;             // of the fields above
+} table_stamp_type;
+
+// min/max of the zone field over a block of consecutive records
+typedef struct {
+  int64_t min;
+  int64_t max;
+} table_zone_type;
+
+// zone map file header: the zones are only valid for the layout they were
+// built with
+typedef struct {
+  uint16_t used_records;    // UINT16_MAX: zones must be rebuilt
+  uint16_t zone_records;
+  uint16_t field_offset;
+  uint8_t field_kind;
+  uint8_t reserved;
+} table_zone_header_type;
+
+typedef enum {
+  TABLE_FIELD_UINT8,
+  TABLE_FIELD_INT8,
+  TABLE_FIELD_UINT16,
+  TABLE_FIELD_INT16,
+  TABLE_FIELD_UINT32,
+  TABLE_FIELD_INT32,
+} table_field_kind_type;
+
+// numeric field stored little-endian inside user_data
+typedef struct {
+  uint16_t offset;
+  table_field_kind_type kind;
+} table_field_type;
+
 typedef struct {  
   char *path;
   char *user_data;
   uint16_t user_data_size;
+  uint16_t record_size;     // user_data_size plus the record CRC, if enabled
   uint16_t capacity;
   uint16_t used_records;
+  uint16_t scrub_cursor;    // next index checked by table_scrub
+  char *zone_path;          // zone map file, NULL if the table has no zone map
+  table_field_type zone_field;
+  uint16_t zone_records;    // records summarised by each zone
+  table_zone_type *zones;
+  SemaphoreHandle_t lock;   // serialises table operations across tasks
+  nvs_handle_t meta_nvs;
+  char meta_key[NVS_KEY_NAME_MAX_SIZE];
+  uint32_t sequence;
+  char *snapshot_path;      // copy-on-write file, NULL if snapshots are not enabled
+  uint8_t *dirty;           // one bit per record changed since the snapshot
+  uint32_t snapshot_id;     // 0 while no snapshot has been taken
+  uint16_t snapshot_used_records;
 } table_handle_type;
 
 #define TABLE_OFFSET_FILE_HEADER 0
 #define TABLE_OFFSET_RECORDS TABLE_OFFSET_FILE_HEADER + sizeof(table_header_type)
+#define TABLE_OFFSET_STAMP(handle) (TABLE_OFFSET_RECORDS + (handle)->capacity*(handle)->record_size)
+
+#define TABLE_SCAN_CHUNK_SIZE 1024  // bytes read per flash access while scanning
+
+#define TABLE_ZONE_COUNT(capacity, zone_records) (((capacity)+(zone_records)-1)/(zone_records))
+#define TABLE_OFFSET_ZONES TABLE_OFFSET_FILE_HEADER + sizeof(table_zone_header_type)
+
+// bytes copied out of every selected record
+typedef struct {
+  uint16_t offset;
+  uint16_t size;
+} table_projection_type;
+
+typedef struct {
+  uint16_t count;
+  int64_t min;
+  int64_t max;
+  int64_t sum;
+} table_aggregate_type;
+
+// returns true if the record (user_data layout) must be selected
+typedef bool (*table_predicate_type)(const char *record, void *arg);
+
+// qsort-style ordering of two records (user_data layout)
+typedef int (*table_comparator_type)(const void *a, const void *b);
+
+// bytes of the dirty bitmap given to table_snapshot_init
+#define TABLE_SNAPSHOT_BITMAP_SIZE(capacity) (((capacity)+7)/8)
+
+// gets every record (user_data layout) handed out by a scan, false to stop
+typedef bool (*table_scan_callback_type)(const char *record, uint16_t index, void *ctx);
+
+#define TABLE_PATH_MAX 64         // table path plus temporary file suffix
+#define TABLE_SORT_MAX_FANIN 8    // runs merged at once by table_sort
 
 bool table_init (table_handle_type *handle,
                  char *path,
@@ -23,11 +124,89 @@ bool table_init (table_handle_type *handle,
                  uint16_t user_data_size,             
                  uint16_t capacity);
 
+void table_deinit(table_handle_type *handle);
 bool table_append(table_handle_type *handle);
+bool table_append_many(table_handle_type *handle, const char *records, uint16_t count);
+bool table_read_range(table_handle_type *handle, uint16_t from, uint16_t count, char *out);
 bool table_clean(table_handle_type *handle);
 bool table_count(table_handle_type *handle);
 bool table_read_index(table_handle_type *handle, uint16_t index);
 bool table_delete_index(table_handle_type *handle, uint16_t index);
 bool table_replace_index(table_handle_type *handle, uint16_t index);
 bool table_insert_index(table_handle_type *handle, uint16_t index);
+bool table_scrub(table_handle_type *handle,
+                 uint16_t records,
+                 uint16_t *corrupted,
+                 uint16_t corrupted_size,
+                 uint16_t *corrupted_count);
+
+uint16_t table_field_size(const table_field_type *field);
+int64_t table_field_value(const char *record, const table_field_type *field);
+bool table_select(table_handle_type *handle,
+                  table_predicate_type predicate,
+                  void *predicate_arg,
+                  const table_projection_type *projection,
+                  char *out,
+                  uint16_t max,
+                  uint16_t *selected);
+bool table_aggregate(table_handle_type *handle,
+                     table_predicate_type predicate,
+                     void *predicate_arg,
+                     const table_field_type *field,
+                     table_aggregate_type *result);
+bool table_zone_map_init(table_handle_type *handle,
+                         char *zone_path,
+                         const table_field_type *field,
+                         uint16_t zone_records,
+                         table_zone_type *zones,
+                         uint16_t zones_count);
+bool table_select_range(table_handle_type *handle,
+                        int64_t low,
+                        int64_t high,
+                        const table_projection_type *projection,
+                        char *out,
+                        uint16_t max,
+                        uint16_t *selected);
+bool table_sort(table_handle_type *handle,
+                table_comparator_type comparator,
+                char *scratch,
+                size_t scratch_size);
+bool table_dedup(table_handle_type *handle,
+                 table_comparator_type comparator,
+                 char *scratch,
+                 size_t scratch_size);
+bool table_snapshot_init(table_handle_type *handle,
+                         char *snapshot_path,
+                         uint8_t *bitmap,
+                         size_t bitmap_size);
+bool table_snapshot(table_handle_type *handle, uint32_t *snapshot_id);
+bool table_snapshot_read_range(table_handle_type *handle,
+                               uint16_t from,
+                               uint16_t count,
+                               char *out);
+bool table_export_delta(table_handle_type *handle,
+                        uint32_t since_snapshot,
+                        table_scan_callback_type callback,
+                        void *ctx,
+                        uint32_t *snapshot_id,
+                        uint16_t *used_records,
+                        bool *full);
+bool table_update_field(table_handle_type *handle,
+                        uint16_t index,
+                        uint16_t field_offset,
+                        uint16_t len,
+                        const char *data);
+bool table_read_field(table_handle_type *handle,
+                      uint16_t index,
+                      const table_field_type *field,
+                      int64_t *value);
+bool table_write_field(table_handle_type *handle,
+                       uint16_t index,
+                       const table_field_type *field,
+                       int64_t value);
+bool table_increment_field(table_handle_type *handle,
+                           uint16_t index,
+                           const table_field_type *field,
+                           int64_t delta,
+                           int64_t *result);
 #endif
\ No newline at end of file
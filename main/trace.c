@@ -0,0 +1,109 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "trace.h"
+#define TAG "trace"
+
+#ifdef CONFIG_STORAGE_TRACE
+
+static trace_event_type trace_ring[CONFIG_STORAGE_TRACE_EVENTS];
+static uint32_t trace_head;        // total events recorded, wraps the ring
+static bool trace_paused;
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void trace_event(const char *name, char phase, uint32_t size)
+{
+  trace_event_type *event;
+
+  if (trace_paused) {
+    return;
+  }
+  portENTER_CRITICAL(&trace_lock);
+  event = &trace_ring[trace_head % CONFIG_STORAGE_TRACE_EVENTS];
+  trace_head++;
+  event->name = name;
+  event->phase = phase;
+  event->size = size;
+  event->task = xTaskGetCurrentTaskHandle();
+  event->timestamp_us = esp_timer_get_time();
+  portEXIT_CRITICAL(&trace_lock);
+}
+
+void trace_clear(void)
+{
+  portENTER_CRITICAL(&trace_lock);
+  trace_head = 0;
+  portEXIT_CRITICAL(&trace_lock);
+}
+
+/* Writes the buffered events, oldest first, as a Chrome trace JSON object.
+ * Recording is paused meanwhile; when the ring has wrapped, an end event may
+ * lose its begin event, which the viewers tolerate. */
+void trace_dump(FILE *out)
+{
+  uint32_t first = 0;
+  bool comma = false;
+
+  trace_paused = true;
+  if (trace_head > CONFIG_STORAGE_TRACE_EVENTS) {
+    first = trace_head - CONFIG_STORAGE_TRACE_EVENTS;
+  }
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (uint32_t i = first; i < trace_head; i++) {
+    trace_event_type *event = &trace_ring[i % CONFIG_STORAGE_TRACE_EVENTS];
+
+    fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%lu,\"args\":{\"size\":%lu}}",
+            comma ? ",\n" : "",
+            event->name,
+            event->phase,
+            (long long) event->timestamp_us,
+            (unsigned long) (uintptr_t) event->task,
+            (unsigned long) event->size);
+    comma = true;
+  }
+  fprintf(out, "\n]}\n");
+  fflush(out);
+  trace_paused = false;
+}
+
+bool trace_dump_to_file(char *path)
+{
+  FILE *f = fopen(path, "w");
+
+  if (NULL == f) {
+    ESP_LOGE(TAG, "Failed to create %s", path);
+    return false;
+  }
+  trace_dump(f);
+  if (fclose(f)) {
+    ESP_LOGE(TAG, "Failed to close %s", path);
+    return false;
+  }
+  return true;
+}
+
+#else
+
+void trace_event(const char *name, char phase, uint32_t size)
+{
+}
+
+void trace_clear(void)
+{
+}
+
+void trace_dump(FILE *out)
+{
+  fprintf(out, "tracing disabled (CONFIG_STORAGE_TRACE)\n");
+}
+
+bool trace_dump_to_file(char *path)
+{
+  return false;
+}
+
+#endif
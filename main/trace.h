@@ -0,0 +1,33 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Begin/end event tracing of storage and table operations into a RAM ring
+ * buffer, dumped as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+ * Compiled out unless CONFIG_STORAGE_TRACE is set. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+typedef struct {
+  const char *name;       // must be a string literal or __FUNCTION__
+  int64_t timestamp_us;
+  void *task;
+  uint32_t size;
+  char phase;             // 'B' or 'E'
+} trace_event_type;
+
+#ifdef CONFIG_STORAGE_TRACE
+#define TRACE_BEGIN(name, size) trace_event((name), 'B', (size))
+#define TRACE_END(name, size)   trace_event((name), 'E', (size))
+#else
+#define TRACE_BEGIN(name, size) ((void)(size))
+#define TRACE_END(name, size)   ((void)(size))
+#endif
+
+void trace_event(const char *name, char phase, uint32_t size);
+void trace_clear(void);
+void trace_dump(FILE *out);
+bool trace_dump_to_file(char *path);
+#endif
@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+"""Bulk load/export of the demo table over UART, using the binary protocol
+described in main/protocol.h.
+
+    table_bulk.py -p /dev/ttyUSB0 info
+    table_bulk.py -p /dev/ttyUSB0 load records.bin [--text] [--clean]
+    table_bulk.py -p /dev/ttyUSB0 export out.bin [--start N] [--count N]
+    table_bulk.py -p /dev/ttyUSB0 sync backup.bin
+
+Records are fixed size (user_data_size, reported by 'info'). With --text the
+input file holds one record per line, padded with NUL bytes.
+
+'sync' keeps backup.bin up to date by fetching only the records changed since
+the previous sync; the device snapshot id is kept in backup.bin.snapshot. The
+first sync, or the first after a device reboot, fetches the whole table.
+
+Requires pyserial.
+"""
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+SOF = 0xA5
+CMD_INFO, CMD_CLEAN, CMD_APPEND, CMD_EXPORT, CMD_DATA, CMD_ACK, CMD_EXIT, CMD_DELTA = range(1, 9)
+RESPONSE = 0x80
+STATUS = {0: "ok", 1: "bad frame", 2: "bad request", 3: "table error", 4: "timeout"}
+
+APPEND_WINDOW = 3   # frames in flight; must fit PROTOCOL_UART_RX_BUFFER
+EXPORT_WINDOW = 4
+
+
+class ProtocolError(Exception):
+    pass
+
+
+class Link:
+    def __init__(self, port, baudrate):
+        self.serial = serial.Serial(port, baudrate, timeout=2)
+        self.seq = 0
+
+    def enter_binary_mode(self):
+        # the text menu reads one option per 20 ms tick
+        self.serial.reset_input_buffer()
+        self.serial.write(b"b")
+        time.sleep(0.2)
+
+    def send(self, cmd, payload=b"", seq=None):
+        if seq is None:
+            seq = self.seq
+            self.seq = (self.seq + 1) & 0xFF
+        body = struct.pack("<HBB", len(payload), cmd, seq) + payload
+        self.serial.write(bytes([SOF]) + body + struct.pack("<I", zlib.crc32(body)))
+        return seq
+
+    def receive(self):
+        while True:
+            byte = self.serial.read(1)
+            if not byte:
+                raise ProtocolError("timeout waiting for frame")
+            if byte[0] == SOF:
+                break
+        header = self.serial.read(4)
+        if len(header) != 4:
+            raise ProtocolError("truncated header")
+        length, cmd, seq = struct.unpack("<HBB", header)
+        rest = self.serial.read(length + 4)
+        if len(rest) != length + 4:
+            raise ProtocolError("truncated frame")
+        payload, crc = rest[:length], struct.unpack("<I", rest[length:])[0]
+        if crc != zlib.crc32(header + payload):
+            raise ProtocolError("CRC mismatch")
+        return cmd, seq, payload
+
+    def response(self, cmd):
+        rcmd, seq, payload = self.receive()
+        if rcmd != cmd | RESPONSE:
+            raise ProtocolError("unexpected frame 0x%02x" % rcmd)
+        if payload[0] != 0:
+            raise ProtocolError("command 0x%02x failed: %s" % (cmd, STATUS.get(payload[0], payload[0])))
+        return seq, payload[1:]
+
+    def request(self, cmd, payload=b""):
+        self.send(cmd, payload)
+        return self.response(cmd)[1]
+
+
+def info(link):
+    payload = link.request(CMD_INFO)
+    version, record_size, capacity, used, max_payload = struct.unpack("<BHHHH", payload)
+    return {"version": version, "record_size": record_size, "capacity": capacity,
+            "used": used, "max_payload": max_payload}
+
+
+def read_records(path, record_size, text):
+    with open(path, "rb") as f:
+        data = f.read()
+    if text:
+        lines = [line for line in data.splitlines() if line]
+        for line in lines:
+            if len(line) >= record_size:
+                sys.exit("record too long: %r" % line)
+        return [line.ljust(record_size, b"\0") for line in lines]
+    if len(data) % record_size:
+        sys.exit("%s is not a multiple of %d bytes" % (path, record_size))
+    return [data[i:i + record_size] for i in range(0, len(data), record_size)]
+
+
+def load(link, table, records):
+    per_frame = table["max_payload"] // table["record_size"]
+    frames = [b"".join(records[i:i + per_frame]) for i in range(0, len(records), per_frame)]
+    in_flight = 0
+    started = time.time()
+    # pipeline: keep APPEND_WINDOW frames queued in the device UART buffer
+    for frame in frames:
+        if in_flight == APPEND_WINDOW:
+            link.response(CMD_APPEND)
+            in_flight -= 1
+        link.send(CMD_APPEND, frame)
+        in_flight += 1
+    used = None
+    while in_flight:
+        used = struct.unpack("<H", link.response(CMD_APPEND)[1])[0]
+        in_flight -= 1
+    elapsed = time.time() - started
+    print("loaded %d records in %.2f s, table now holds %s" % (len(records), elapsed, used))
+
+
+def export(link, table, path, start, count):
+    size = table["record_size"]
+    if count is None:
+        count = table["used"] - start
+    seq = link.send(CMD_EXPORT, struct.pack("<HHB", start, count, EXPORT_WINDOW))
+    records = {}
+    while True:
+        cmd, data_seq, payload = link.receive()
+        if cmd == CMD_DATA:
+            # first record index, then records packed back to back
+            index = struct.unpack("<H", payload[:2])[0]
+            if (len(payload) - 2) % size:
+                raise ProtocolError("DATA frame of %d bytes is not whole records" % len(payload))
+            for offset in range(2, len(payload), size):
+                records[index] = payload[offset:offset + size]
+                index += 1
+            link.send(CMD_ACK, seq=data_seq)
+        elif cmd == CMD_EXPORT | RESPONSE:
+            if payload[0] != 0:
+                raise ProtocolError("export failed: %s" % STATUS.get(payload[0], payload[0]))
+            sent = struct.unpack("<H", payload[1:3])[0]
+            break
+        else:
+            raise ProtocolError("unexpected frame 0x%02x (request %d)" % (cmd, seq))
+    # a short or gapped export would shift every record after the hole
+    if sent != count or sorted(records) != list(range(start, start + count)):
+        raise ProtocolError("export incomplete: %d records requested, %d reported sent, %d received"
+                            % (count, sent, len(records)))
+    with open(path, "wb") as f:
+        for index in range(start, start + count):
+            f.write(records[index])
+    print("exported %d records to %s" % (count, path))
+
+
+def sync(link, table, path):
+    size = table["record_size"]
+    state = path + ".snapshot"
+    try:
+        with open(state) as f:
+            since = int(f.read())
+        records = read_records(path, size, False)
+    except (OSError, ValueError):
+        since, records = 0, []
+    seq = link.send(CMD_DELTA, struct.pack("<IB", since, EXPORT_WINDOW))
+    changes = {}
+    while True:
+        cmd, data_seq, payload = link.receive()
+        if cmd == CMD_DATA:
+            for offset in range(0, len(payload), 2 + size):
+                index = struct.unpack("<H", payload[offset:offset + 2])[0]
+                changes[index] = payload[offset + 2:offset + 2 + size]
+            link.send(CMD_ACK, seq=data_seq)
+        elif cmd == CMD_DELTA | RESPONSE:
+            if payload[0] != 0:
+                raise ProtocolError("delta failed: %s" % STATUS.get(payload[0], payload[0]))
+            full, used, snapshot, sent = struct.unpack("<BHIH", payload[1:10])
+            break
+        else:
+            raise ProtocolError("unexpected frame 0x%02x (request %d)" % (cmd, seq))
+    if full:
+        records = []
+    records = records[:used] + [b"\0" * size] * (used - len(records))
+    for index, record in changes.items():
+        records[index] = record
+    with open(path, "wb") as f:
+        f.write(b"".join(records))
+    with open(state, "w") as f:
+        f.write("%d\n" % snapshot)
+    print("%s sync: %d records fetched, table holds %d" % ("full" if full else "delta", sent, used))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-p", "--port", required=True)
+    parser.add_argument("-b", "--baudrate", type=int, default=115200)
+    sub = parser.add_subparsers(dest="command", required=True)
+    sub.add_parser("info")
+    p_load = sub.add_parser("load")
+    p_load.add_argument("file")
+    p_load.add_argument("--text", action="store_true")
+    p_load.add_argument("--clean", action="store_true")
+    p_export = sub.add_parser("export")
+    p_export.add_argument("file")
+    p_export.add_argument("--start", type=int, default=0)
+    p_export.add_argument("--count", type=int)
+    p_sync = sub.add_parser("sync")
+    p_sync.add_argument("file")
+    args = parser.parse_args()
+
+    link = Link(args.port, args.baudrate)
+    link.enter_binary_mode()
+    try:
+        table = info(link)
+        if args.command == "info":
+            print(table)
+        elif args.command == "load":
+            if args.clean:
+                link.request(CMD_CLEAN)
+            load(link, table, read_records(args.file, table["record_size"], args.text))
+        elif args.command == "export":
+            export(link, table, args.file, args.start, args.count)
+        elif args.command == "sync":
+            sync(link, table, args.file)
+    finally:
+        link.request(CMD_EXIT)
+
+
+if __name__ == "__main__":
+    main()